@@ -0,0 +1,401 @@
+/* bxbench - benchmarks for bxtools on synthetic linked-read BAMs
+ *
+ * Each subcommand is run in a forked child on a generated BAM, so that it
+ * starts from a clean slate (options, optind, memory) and its peak RSS can
+ * be read back with wait4. The micro benchmarks run in process.
+ */
+
+#include <getopt.h>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <chrono>
+#include <unordered_map>
+#include <memory>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "SeqLib/BamRecord.h"
+
+#include "bxsynth.h"
+#include "bxcommon.h"
+#include "bxaux.h"
+#include "bxdict.h"
+#include "bxdictfile.h"
+#include "bxraw.h"
+#include "bxsplit.h"
+#include "bxstats.h"
+#include "bxtile.h"
+#include "bxmol.h"
+#include "bxconvert.h"
+#include "bxrelabel.h"
+#include "bxvisitor.h"
+
+namespace opt {
+
+  static BXSynthOptions synth;
+  static std::string order = "both"; // sorted, unsorted or both
+  static std::string only; // comma separated benchmark names to run
+  static std::string tmp = "/tmp"; // where to write the BAMs
+  static int repeats = 1; // report the fastest of this many runs
+  static size_t micro = 200000; // reads held in memory for the micro benchmarks
+  static bool verbose = false; // keep the output of the subcommands
+}
+
+static const char* shortopts = "hvn:b:M:L:O:c:T:r:m:@:";
+static const struct option longopts[] = {
+  { "help",                    no_argument, NULL, 'h' },
+  { "verbose",                 no_argument, NULL, 'v' },
+  { "reads",                   required_argument, NULL, 'n' },
+  { "barcodes",                required_argument, NULL, 'b' },
+  { "mols-per-bx",             required_argument, NULL, 'M' },
+  { "mol-len",                 required_argument, NULL, 'L' },
+  { "order",                   required_argument, NULL, 'O' },
+  { "only",                    required_argument, NULL, 'c' },
+  { "tmp",                     required_argument, NULL, 'T' },
+  { "repeats",                 required_argument, NULL, 'r' },
+  { "micro",                   required_argument, NULL, 'm' },
+  { "threads",                 required_argument, NULL, '@' },
+  { NULL, 0, NULL, 0 }
+};
+
+static const char *BENCH_USAGE_MESSAGE =
+"Usage: bxbench [options] > bench.tsv\n"
+"Description: Time bxtools on synthetic linked-read BAMs. Writes records/s and peak RSS\n"
+"             for each subcommand, and records/s for the tag, map and visitor micro benchmarks\n"
+"\n"
+"  General options\n"
+"  -v, --verbose         Show the output of the subcommands\n"
+"  -n, --reads           Number of reads [1,000,000]\n"
+"  -b, --barcodes        Number of distinct barcodes [100,000]\n"
+"  -M, --mols-per-bx     Molecules per barcode [10]\n"
+"  -L, --mol-len         Mean molecule length [50,000]\n"
+"  -O, --order           Input order: sorted, unsorted or both [both]\n"
+"  -c, --only            Only run these benchmarks (comma separated, e.g. split,tag)\n"
+"  -T, --tmp             Directory for the generated BAMs [/tmp]\n"
+"  -r, --repeats         Report the fastest of this many runs [1]\n"
+"  -m, --micro           Reads held in memory for the micro benchmarks [200,000]\n"
+"  -@, --threads         Threads for BAM compression and decompression [1]\n"
+"\n";
+
+// one subcommand run
+struct BXBenchCommand {
+  std::string name;
+  void (*run)(int, char**);
+  std::vector<std::string> args; // after the BAM
+  bool sorted; // needs sorted input
+};
+
+static const std::vector<BXBenchCommand> COMMANDS = {
+  { "split",       runSplit,   { "-x" }, false },
+  { "split-o",     runSplit,   { "-o", "grouped.bam" }, false },
+  { "stats",       runStat,    {}, false },
+  { "stats-s",     runStat,    { "-s" }, false },
+  { "tile",        runTile,    {}, false },
+  { "tile-matrix", runTile,    { "-o", "tiles.bxm" }, false },
+  { "mol",         runMol,     {}, false },
+  { "mol-s",       runMol,     { "-s" }, true },
+  { "convert-s",   runConvert, { "-s" }, false },
+  { "relabel",     runRelabel, {}, false },
+};
+
+static void parseOptions(int argc, char** argv);
+
+static bool selected(const std::string& name) {
+  if (opt::only.empty())
+    return true;
+  std::stringstream ss(opt::only);
+  std::string s;
+  while (std::getline(ss, s, ','))
+    if (s == name || name.compare(0, s.size() + 1, s + "-") == 0 || name.compare(0, s.size() + 1, s + ".") == 0)
+      return true;
+  return false;
+}
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const std::string& name, const std::string& order, size_t reads, double secs, long rss_kb) {
+  std::cout << name << "\t" << order << "\t" << reads << "\t" << std::fixed << std::setprecision(3) << secs
+	    << "\t" << std::setprecision(0) << (secs > 0 ? reads / secs : 0) << "\t";
+  if (rss_kb >= 0)
+    std::cout << std::setprecision(1) << rss_kb / 1024.0;
+  else
+    std::cout << "NA";
+  std::cout << std::endl;
+}
+
+// run a subcommand in a child process, the way main() would. Returns the
+// wall time, and the peak RSS of the child in rss_kb
+static double runChild(const BXBenchCommand& c, const std::string& bam, long& rss_kb) {
+
+  std::cout.flush();
+  const auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    std::cerr << "fork failed" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    if (!opt::verbose)
+      dup2(null, STDERR_FILENO);
+    std::vector<std::string> args = { c.name, bam };
+    args.insert(args.end(), c.args.begin(), c.args.end());
+    std::vector<char*> argv;
+    for (auto& a : args)
+      argv.push_back(&a[0]);
+    argv.push_back(nullptr);
+    optind = 0;
+    c.run(argv.size() - 1, argv.data());
+    std::cout.flush();
+    exit(EXIT_SUCCESS);
+  }
+
+  int status;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    std::cerr << "Benchmark " << c.name << " failed (rerun with -v to see why)" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  rss_kb = ru.ru_maxrss;
+  return seconds(start);
+}
+
+// remove everything the runs wrote to the scratch directory
+static void cleanDir(const std::string& dir) {
+  DIR* d = opendir(dir.c_str());
+  if (!d)
+    return;
+  while (struct dirent* e = readdir(d))
+    if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+      std::remove((dir + "/" + e->d_name).c_str());
+  closedir(d);
+  rmdir(dir.c_str());
+}
+
+// time f over all of the reads, repeating passes until it has run for a
+// while. Returns reads per second
+template <class F>
+static double microLoop(size_t n, F f) {
+  size_t done = 0;
+  const auto start = std::chrono::steady_clock::now();
+  double t;
+  do {
+    for (size_t i = 0; i < n; ++i)
+      f(i);
+    done += n;
+  } while ((t = seconds(start)) < 0.5);
+  return done / t;
+}
+
+static volatile size_t bench_sink;
+
+static void runMicro(const BXSynth& synth, const std::string& order) {
+
+  const size_t n = std::min(opt::micro, synth.size());
+  std::vector<SeqLib::BamRecord> reads(n);
+  for (size_t i = 0; i < n; ++i) {
+    bam1_t* b = bam_init1();
+    synth.Record(i, b);
+    reads[i].assign(b);
+  }
+
+  std::vector<std::string> bxs(n);
+  for (size_t i = 0; i < n; ++i)
+    reads[i].GetZTag("BX", bxs[i]);
+
+  size_t sink = 0;
+  if (selected("tag.seqlib")) {
+    std::string s;
+    const double rate = microLoop(n, [&](size_t i) { reads[i].GetZTag("BX", s); sink += s.size(); });
+    report("tag.seqlib", order, n, n / rate, -1);
+  }
+  if (selected("tag.raw")) {
+    char buf[32];
+    const double rate = microLoop(n, [&](size_t i) {
+	const char* v = BXTagValue(reads[i].raw(), "BX", buf, sizeof(buf));
+	sink += v ? v[0] : 0;
+      });
+    report("tag.raw", order, n, n / rate, -1);
+  }
+  if (selected("tag.aux")) {
+    BXAux aux("BX", "MI", "AS");
+    const double rate = microLoop(n, [&](size_t i) {
+	BXStrRef bx;
+	int64_t mi = 0, as = 0;
+	aux.Scan(reads[i].raw());
+	aux.Z(0, bx);
+	aux.Int(1, mi);
+	aux.Int(2, as);
+	sink += bx.size + mi + as;
+      });
+    report("tag.aux", order, n, n / rate, -1);
+  }
+  if (selected("map.string")) {
+    std::unordered_map<std::string, size_t> counts;
+    const double rate = microLoop(n, [&](size_t i) { ++counts[bxs[i]]; });
+    sink += counts.size();
+    report("map.string", order, n, n / rate, -1);
+  }
+  if (selected("map.bxdict")) {
+    BXDict dict;
+    std::unordered_map<BXID, size_t, BXHash> counts;
+    const double rate = microLoop(n, [&](size_t i) { ++counts[dict.Encode(bxs[i])]; });
+    sink += counts.size();
+    report("map.bxdict", order, n, n / rate, -1);
+  }
+  if (selected("map.dictfile")) {
+    std::vector<std::string> sorted(bxs);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    BXDictFile file;
+    if (!BXDictFile::Write(order + ".bxd", sorted) || !file.Open(order + ".bxd")) {
+      std::cerr << "Could not write a barcode dictionary" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    BXDict dict(&file);
+    std::unordered_map<BXID, size_t, BXHash> counts;
+    const double rate = microLoop(n, [&](size_t i) { ++counts[dict.Encode(bxs[i])]; });
+    sink += counts.size();
+    report("map.dictfile", order, n, n / rate, -1);
+  }
+  if (selected("visit.mol")) {
+    // mol with its defaults reads BX as both the molecule and the barcode
+    // tag. Check that the barcode column of the BED still holds it
+    SeqLib::BamHeader hdr(synth.HeaderText());
+    std::ostringstream bed;
+    std::vector<std::string> args = { "mol", "-" };
+    std::vector<char*> argv;
+    for (auto& a : args)
+      argv.push_back(&a[0]);
+    argv.push_back(nullptr);
+    optind = 0;
+    std::unique_ptr<BXVisitor> mol(NewMolVisitor(argv.size() - 1, argv.data(), hdr, bed));
+    const double rate = microLoop(n, [&](size_t i) { mol->Visit(reads[i]); });
+    mol->Finish();
+    std::istringstream in(bed.str());
+    std::string line;
+    size_t mols = 0;
+    while (std::getline(in, line)) {
+      std::vector<std::string> f;
+      std::stringstream ls(line);
+      for (std::string x; std::getline(ls, x, '\t');)
+	f.push_back(x);
+      if (f.size() < 6 || f[4].empty() || f[4] != f[3]) {
+	std::cerr << "mol wrote a molecule without its barcode: " << line << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      ++mols;
+    }
+    sink += mols;
+    report("visit.mol", order, n, n / rate, -1);
+  }
+  bench_sink = sink; // keep the loops from being optimized away
+}
+
+int main(int argc, char** argv) {
+
+  parseOptions(argc, argv);
+
+  char tmpl[4096];
+  snprintf(tmpl, sizeof(tmpl), "%s/bxbench.XXXXXX", opt::tmp.c_str());
+  if (!mkdtemp(tmpl)) {
+    std::cerr << "Could not make a scratch directory in " << opt::tmp << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  const std::string dir = tmpl;
+  if (chdir(dir.c_str()) != 0) {
+    std::cerr << "Could not change to " << dir << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  std::cout << "benchmark\torder\treads\tseconds\treads_per_sec\tpeak_rss_mb" << std::endl;
+
+  for (int sorted = 1; sorted >= 0; --sorted) {
+
+    const std::string order = sorted ? "sorted" : "unsorted";
+    if (opt::order != "both" && opt::order != order)
+      continue;
+
+    BXSynthOptions so = opt::synth;
+    so.sorted = sorted;
+    std::cerr << "...generating " << so.reads << " " << order << " reads with "
+	      << so.barcodes << " barcodes" << std::endl;
+    const std::string bam = dir + "/" + order + ".bam";
+    {
+      BXSynth synth(so);
+      if (!synth.Write(bam)) {
+	std::cerr << "Could not write " << bam << std::endl;
+	exit(EXIT_FAILURE);
+      }
+    }
+
+    // subcommands first, while this process is still small, as a forked
+    // child counts the pages it shares with the parent
+    for (const auto& c : COMMANDS) {
+      if (!selected(c.name) || (c.sorted && !sorted))
+	continue;
+      double best = -1;
+      long rss = -1;
+      for (int r = 0; r < std::max(1, opt::repeats); ++r) {
+	long kb;
+	const double t = runChild(c, bam, kb);
+	if (best < 0 || t < best) {
+	  best = t;
+	  rss = kb;
+	}
+      }
+      report(c.name, order, so.reads, best, rss);
+    }
+
+    runMicro(BXSynth(so), order);
+  }
+
+  cleanDir(dir);
+  return 0;
+}
+
+static void parseOptions(int argc, char** argv) {
+
+  bool die = false;
+  bool help = false;
+
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v': opt::verbose = true; break;
+    case 'h': help = true; break;
+    case 'n': arg >> opt::synth.reads; break;
+    case 'b': arg >> opt::synth.barcodes; break;
+    case 'M': arg >> opt::synth.mols_per_bx; break;
+    case 'L': arg >> opt::synth.mol_len; break;
+    case 'O': arg >> opt::order; break;
+    case 'c': arg >> opt::only; break;
+    case 'T': arg >> opt::tmp; break;
+    case 'r': arg >> opt::repeats; break;
+    case 'm': arg >> opt::micro; break;
+    case '@': arg >> bxtools::threads; break;
+    default: die = true;
+    }
+  }
+
+  if (opt::order != "both" && opt::order != "sorted" && opt::order != "unsorted")
+    die = true;
+
+  if (die || help) {
+    std::cerr << "\n" << BENCH_USAGE_MESSAGE;
+    die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
+  }
+}
@@ -0,0 +1,160 @@
+#include "bxsynth.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include "SeqLib/BamHeader.h"
+
+namespace {
+
+  // splitmix64, so the reads don't depend on the standard library
+  struct BXRng {
+    uint64_t s;
+    explicit BXRng(uint64_t seed) : s(seed) {}
+    uint64_t operator()() {
+      uint64_t z = (s += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      return z ^ (z >> 31);
+    }
+    uint32_t below(uint32_t n) { return n ? (*this)() % n : 0; }
+  };
+
+  void putAux(uint8_t*& p, const char* tag, char type) {
+    *p++ = tag[0];
+    *p++ = tag[1];
+    *p++ = type;
+  }
+
+  void putInt(uint8_t*& p, int32_t v) {
+    memcpy(p, &v, sizeof(v));
+    p += sizeof(v);
+  }
+}
+
+BXSynth::BXSynth(const BXSynthOptions& o) : m_opt(o) {
+
+  m_opt.chroms = std::max(1, m_opt.chroms);
+  m_opt.barcodes = std::max((size_t)1, m_opt.barcodes);
+  m_opt.mol_len = std::max(2, m_opt.mol_len);
+  m_opt.chr_len = std::max(m_opt.chr_len, 2 * m_opt.mol_len + m_opt.read_len + 1);
+
+  BXRng rng(m_opt.seed);
+  m_mols.resize(m_opt.barcodes * std::max(1, m_opt.mols_per_bx));
+  for (size_t k = 0; k < m_mols.size(); ++k) {
+    Mol& m = m_mols[k];
+    m.tid = rng.below(m_opt.chroms);
+    m.len = m_opt.mol_len / 2 + rng.below(m_opt.mol_len);
+    m.start = rng.below(m_opt.chr_len - m.len - m_opt.read_len);
+    m.bx = k % m_opt.barcodes;
+  }
+
+  // molecules are picked at random, so the reads are already shuffled
+  m_reads.resize(m_opt.reads);
+  for (auto& r : m_reads) {
+    r.mol = rng.below(m_mols.size());
+    r.tid = m_mols[r.mol].tid;
+    r.pos = m_mols[r.mol].start + rng.below(m_mols[r.mol].len);
+  }
+  if (m_opt.sorted)
+    std::sort(m_reads.begin(), m_reads.end(), [](const Read& a, const Read& b) {
+	return a.tid < b.tid || (a.tid == b.tid && a.pos < b.pos);
+      });
+}
+
+std::string BXSynth::HeaderText() const {
+  std::string h = std::string("@HD\tVN:1.4\tSO:") + (m_opt.sorted ? "coordinate" : "unsorted") + "\n";
+  for (int c = 0; c < m_opt.chroms; ++c)
+    h += "@SQ\tSN:chr" + std::to_string(c + 1) + "\tLN:" + std::to_string(m_opt.chr_len) + "\n";
+  return h;
+}
+
+std::string BXSynth::Barcode(uint32_t k) {
+  // a bijective mix, so distinct k give distinct barcodes
+  uint32_t x = k;
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  std::string bx(16, 'A');
+  for (int j = 0; j < 16; ++j)
+    bx[j] = "ACGT"[(x >> (2 * j)) & 3];
+  return bx + "-1";
+}
+
+void BXSynth::Record(size_t i, bam1_t* b) const {
+
+  const Read& r = m_reads[i];
+  const Mol& m = m_mols[r.mol];
+  const int len = m_opt.read_len;
+  const bool second = i & 1;
+
+  char qname[32];
+  const int l_qname = snprintf(qname, sizeof(qname), "r%010zu", i) + 1;
+  const std::string bx = Barcode(m.bx);
+  const int l_seq = (len + 1) / 2;
+  const int l_aux = 3 + bx.size() + 1 + 2 * (3 + 4);
+  const int l_data = l_qname + 4 + l_seq + len + l_aux;
+
+  if (b->m_data < (uint32_t)l_data) {
+    b->m_data = l_data;
+    b->data = (uint8_t*)realloc(b->data, l_data);
+    if (!b->data) {
+      std::cerr << "Out of memory making synthetic read" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  b->l_data = l_data;
+
+  memset(&b->core, 0, sizeof(b->core));
+  b->core.tid = r.tid;
+  b->core.pos = r.pos;
+  b->core.bin = hts_reg2bin(r.pos, r.pos + len, 14, 5);
+  b->core.qual = 60;
+  b->core.l_qname = l_qname;
+  b->core.flag = BAM_FPAIRED | BAM_FPROPER_PAIR |
+    (second ? BAM_FREAD2 | BAM_FREVERSE : BAM_FREAD1 | BAM_FMREVERSE);
+  b->core.n_cigar = 1;
+  b->core.l_qseq = len;
+  b->core.mtid = r.tid;
+  b->core.mpos = std::max(0, r.pos + (second ? -300 : 300));
+  b->core.isize = second ? -(300 + len) : 300 + len;
+
+  uint8_t* p = b->data;
+  memcpy(p, qname, l_qname);
+  p += l_qname;
+  const uint32_t cigar = (uint32_t)len << BAM_CIGAR_SHIFT | BAM_CMATCH;
+  memcpy(p, &cigar, 4);
+  p += 4;
+  for (int j = 0; j < l_seq; ++j) // bases from the position, as 4 bit codes for ACGT
+    *p++ = (1 << ((r.pos + 2 * j) & 3)) << 4 | (1 << ((r.pos + 2 * j + 1) & 3));
+  memset(p, 30, len);
+  p += len;
+
+  putAux(p, "BX", 'Z');
+  memcpy(p, bx.c_str(), bx.size() + 1);
+  p += bx.size() + 1;
+  putAux(p, "MI", 'i');
+  putInt(p, r.mol);
+  putAux(p, "AS", 'i');
+  putInt(p, len - (int)(i % 10));
+}
+
+bool BXSynth::Write(const std::string& fn) const {
+
+  htsFile* out = sam_open(fn.c_str(), "wb");
+  SeqLib::BamHeader hdr(HeaderText());
+  if (!out || sam_hdr_write(out, hdr.get_()) < 0)
+    return false;
+  bam1_t* b = bam_init1();
+  bool ok = true;
+  for (size_t i = 0; i < m_reads.size() && ok; ++i) {
+    Record(i, b);
+    ok = sam_write1(out, hdr.get_(), b) >= 0;
+  }
+  bam_destroy1(b);
+  return sam_close(out) >= 0 && ok;
+}
@@ -0,0 +1,68 @@
+#ifndef BXTOOLS_BXSYNTH_H__
+#define BXTOOLS_BXSYNTH_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "htslib/sam.h"
+
+struct BXSynthOptions {
+  size_t reads = 1000000;   // number of reads
+  size_t barcodes = 100000; // number of distinct BX tags
+  int mols_per_bx = 10;     // molecules per barcode
+  int mol_len = 50000;      // mean molecule length
+  bool sorted = true;       // coordinate sorted, else shuffled
+  int read_len = 150;
+  int chroms = 4;
+  int chr_len = 50000000;
+  uint64_t seed = 42;
+};
+
+// Synthetic linked-read BAM. Molecules are dropped uniformly on the genome
+// with lengths uniform in [mol_len/2, 3*mol_len/2), each belongs to one
+// barcode, and reads are placed uniformly on a random molecule. Reads carry
+// BX:Z (16 bases, -1), MI:i and AS:i tags, and look like properly paired
+// 150 bp reads. Only the layout (a few bytes per read) is held in memory;
+// records are built on demand. The same options always give the same reads
+class BXSynth {
+
+ public:
+
+  explicit BXSynth(const BXSynthOptions& o);
+
+  std::string HeaderText() const;
+
+  size_t size() const { return m_reads.size(); }
+
+  // fill b with read i
+  void Record(size_t i, bam1_t* b) const;
+
+  // write every read to a BAM file
+  bool Write(const std::string& fn) const;
+
+  // the barcode of molecule group k
+  static std::string Barcode(uint32_t k);
+
+ private:
+
+  struct Mol {
+    int32_t tid;
+    int32_t start;
+    int32_t len;
+    uint32_t bx;
+  };
+
+  struct Read {
+    int32_t tid;
+    int32_t pos;
+    uint32_t mol;
+  };
+
+  BXSynthOptions m_opt;
+  std::vector<Mol> m_mols;
+  std::vector<Read> m_reads;
+
+};
+
+#endif
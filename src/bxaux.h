@@ -0,0 +1,190 @@
+#ifndef BXTOOLS_BXAUX_H__
+#define BXTOOLS_BXAUX_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <ostream>
+
+#include "htslib/sam.h"
+
+// Tag access without copies. BXAux walks a record's aux block once and
+// finds every tag it was asked for, handing back pointers into the record.
+// Hot loops use it instead of BamRecord::GetTag, which walks the block again
+// for each tag and copies the value into a std::string.
+
+// a string held elsewhere (in a record, a static, a buffer). Only valid as
+// long as what it points into
+struct BXStrRef {
+
+  const char* data;
+  size_t size;
+
+  BXStrRef() : data(""), size(0) {}
+  BXStrRef(const char* d, size_t n) : data(d), size(n) {}
+  explicit BXStrRef(const char* s) : data(s), size(strlen(s)) {}
+
+  bool empty() const { return size == 0; }
+
+  std::string str() const { return std::string(data, size); }
+
+  bool operator==(const char* s) const { return strlen(s) == size && !memcmp(data, s, size); }
+
+  friend std::ostream& operator<<(std::ostream& out, const BXStrRef& s) {
+    return out.write(s.data, s.size);
+  }
+};
+
+class BXAux {
+
+ public:
+
+  static const int MAX_TAGS = 4;
+
+  // the tags to look for, in slots 0, 1, ...
+  BXAux(const char* t0, const char* t1 = nullptr, const char* t2 = nullptr, const char* t3 = nullptr)
+    : m_n(0) {
+    const char* t[MAX_TAGS] = { t0, t1, t2, t3 };
+    for (int i = 0; i < MAX_TAGS && t[i]; ++i, ++m_n)
+      memcpy(m_tag[i], t[i], 2);
+    clear();
+  }
+
+  // find the tags in b. Returns how many slots were filled; a tag asked for
+  // in two slots fills both. The values point into b, so they go stale once
+  // it is changed or reused
+  int Scan(const bam1_t* b) {
+    clear();
+    const uint8_t* p = bam_get_aux(b);
+    const uint8_t* end = b->data + b->l_data;
+    int found = 0;
+    while (found < m_n && p + 3 <= end) {
+      const uint8_t* v = p + 2; // type, then value
+      const size_t len = size(v, end);
+      if (!len)
+	break; // corrupt or truncated aux data
+      for (int i = 0; i < m_n; ++i)
+	if (!m_val[i] && p[0] == m_tag[i][0] && p[1] == m_tag[i][1]) {
+	  m_val[i] = v;
+	  m_len[i] = len;
+	  ++found;
+	}
+      p = v + len;
+    }
+    return found;
+  }
+
+  bool Has(int i) const { return m_val[i] != nullptr; }
+
+  // the type byte and value of tag i, as bam_aux_get gives it, or null
+  const uint8_t* Get(int i) const { return m_val[i]; }
+
+  // a Z or H tag
+  bool Z(int i, BXStrRef& s) const {
+    if (!m_val[i] || (*m_val[i] != 'Z' && *m_val[i] != 'H'))
+      return false;
+    s = BXStrRef((const char*)m_val[i] + 1, m_len[i] - 2); // less the type and NUL
+    return true;
+  }
+
+  // any of the integer types
+  bool Int(int i, int64_t& x) const {
+    if (!m_val[i])
+      return false;
+    const uint8_t* v = m_val[i] + 1;
+    switch (*m_val[i]) {
+    case 'c': x = (int8_t)*v; return true;
+    case 'C': x = *v; return true;
+    case 's': x = get<int16_t>(v); return true;
+    case 'S': x = get<uint16_t>(v); return true;
+    case 'i': x = get<int32_t>(v); return true;
+    case 'I': x = get<uint32_t>(v); return true;
+    }
+    return false;
+  }
+
+  // f or d tags
+  bool Float(int i, double& x) const {
+    if (!m_val[i])
+      return false;
+    if (*m_val[i] == 'f')
+      x = get<float>(m_val[i] + 1);
+    else if (*m_val[i] == 'd')
+      x = get<double>(m_val[i] + 1);
+    else
+      return false;
+    return true;
+  }
+
+  // the tag as text, the way BamRecord::GetTag has it: strings as they are,
+  // characters and integers formatted (into a buffer held here)
+  bool Text(int i, BXStrRef& s) {
+    if (Z(i, s))
+      return true;
+    int64_t x;
+    if (Int(i, x)) {
+      s = BXStrRef(m_buf[i], snprintf(m_buf[i], sizeof(m_buf[i]), "%lld", (long long)x));
+      return true;
+    }
+    if (m_val[i] && *m_val[i] == 'A') {
+      s = BXStrRef((const char*)m_val[i] + 1, 1);
+      return true;
+    }
+    return false;
+  }
+
+ private:
+
+  void clear() {
+    for (int i = 0; i < MAX_TAGS; ++i)
+      m_val[i] = nullptr;
+  }
+
+  template <typename T>
+  static T get(const uint8_t* p) {
+    T x;
+    memcpy(&x, p, sizeof(T)); // aux values are not aligned
+    return x;
+  }
+
+  // bytes taken by the type and value at v, or 0 if it runs past end
+  static size_t size(const uint8_t* v, const uint8_t* end) {
+    size_t n;
+    switch (*v) {
+    case 'A': case 'c': case 'C': n = 1; break;
+    case 's': case 'S': n = 2; break;
+    case 'i': case 'I': case 'f': n = 4; break;
+    case 'd': n = 8; break;
+    case 'Z': case 'H': {
+      const void* nul = memchr(v + 1, '\0', end - v - 1);
+      if (!nul)
+	return 0;
+      n = (const uint8_t*)nul - v;
+      break;
+    }
+    case 'B': {
+      if (end - v < 6)
+	return 0;
+      const size_t w = size(v + 1, end); // the element type's width, plus one
+      if (w < 2 || w > 5 || v[1] == 'A')
+	return 0;
+      n = 5 + (w - 1) * (size_t)get<uint32_t>(v + 2);
+      break;
+    }
+    default:
+      return 0;
+    }
+    return (size_t)(end - v) > n ? n + 1 : 0;
+  }
+
+  char m_tag[MAX_TAGS][2];
+  int m_n;
+  const uint8_t* m_val[MAX_TAGS];
+  size_t m_len[MAX_TAGS];
+  char m_buf[MAX_TAGS][24];
+
+};
+
+#endif
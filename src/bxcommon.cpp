@@ -0,0 +1,48 @@
+#include "bxcommon.h"
+#include "bxdictfile.h"
+
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+
+namespace bxtools {
+
+  int threads = 1;
+
+  SeqLib::ThreadPool& GetThreadPool() {
+    static SeqLib::ThreadPool pool(threads);
+    return pool;
+  }
+
+  std::string dict_file;
+
+  const BXDictFile* GetDict() {
+    static const BXDictFile* file = []() -> const BXDictFile* {
+      if (dict_file.empty())
+	return nullptr;
+      BXDictFile* f = new BXDictFile;
+      if (!f->Open(dict_file)) {
+	std::cerr << "Failed to open barcode dictionary: " << dict_file << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      return f;
+    }();
+    return file;
+  }
+
+  std::string UnsortedHeader(const std::string& text) {
+    std::string hd = "@HD\tVN:1.4";
+    size_t rest = 0;
+    if (text.compare(0, 4, "@HD\t") == 0) {
+      const size_t eol = text.find('\n');
+      rest = eol == std::string::npos ? text.size() : eol + 1;
+      hd = "@HD";
+      std::istringstream fields(text.substr(4, rest - 4));
+      for (std::string f; std::getline(fields, f, '\t');)
+	if (!f.empty() && f != "\n" && f.compare(0, 3, "SO:") && f.compare(0, 3, "GO:") && f.compare(0, 3, "SS:"))
+	  hd += "\t" + f.substr(0, f.find('\n'));
+    }
+    return hd + "\tSO:unsorted\n" + text.substr(rest);
+  }
+
+}
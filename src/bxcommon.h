@@ -1,11 +1,42 @@
 #ifndef BXTOOLS_BXCOMMON_H__
 #define BXTOOLS_BXCOMMON_H__
 
+#include <string>
+
+#include "SeqLib/ThreadPool.h"
+
+class BXDictFile;
+
+namespace bxtools {
+
+  // number of threads for BGZF (de)compression. Set by -@ in main()
+  extern int threads;
+
+  // htslib thread pool shared by every reader and writer, made on first use
+  SeqLib::ThreadPool& GetThreadPool();
+
+  // barcode dictionary file. Set by --dict in main()
+  extern std::string dict_file;
+
+  // the mapped dictionary file, opened on first use, or null if there is none
+  const BXDictFile* GetDict();
+
+  // header text with the @HD line set to SO:unsorted (and any GO or SS
+  // dropped), for output that is no longer in the order of the input
+  std::string UnsortedHeader(const std::string& text);
+}
+
+// hand the shared thread pool to an open reader or writer
+#define BXTHREADS(io)						\
+  if (bxtools::threads > 1)					\
+    io.SetThreadPool(bxtools::GetThreadPool());
+
 #define BXOPEN(reader, bam)			\
   if (!reader.Open(bam)) {				     \
     std::cerr << "Failed to open bam: " << bam << std::endl; \
     exit(EXIT_FAILURE); \
   }			\
+  BXTHREADS(reader)
 
 #define BXLOOPCHECK(r, found, tag)						\
     ++count;								\
@@ -4,22 +4,33 @@
 #include <iostream>
 #include <algorithm>
 #include <sstream>
-#include <cassert>
+#include <unordered_set>
+#include <cstring>
 
 #include "SeqLib/BamReader.h"
 #include "SeqLib/BamWriter.h"
 #include "SeqLib/GenomicRegionCollection.h"
 
 #include "bxcommon.h"
+#include "bxprof.h"
+#include "bxsort.h"
+#include "bxaux.h"
+#include "bxdict.h"
+#include "bxdictfile.h"
 
 static const char *CONVERT_USAGE_MESSAGE =
 "Usage: bxtools convert <BAM/SAM/CRAM> > converted.bam\n"
 "Description: Convert a BAM to a BX sorted BAM by switching BX and chromosome\n"
+"             With --dict the chromosomes are the dictionary's barcodes by ID, then Empty (which also\n"
+"             takes barcodes not in it), and the conversion is one pass that allows stdin\n"
 "\n"
 "  General options\n"
 "  -v, --verbose         Set verbose output\n"
 "  -k, --keep-tags       Add chromosome tag (CR) and position (PS) tag, and keep other tags. Default: delete all tags\n"
 "  -t, --tag             Tag to flip for chromosome. Default: BX\n"
+"  -s, --sort            Single pass: sort by tag with temporary files and emit a BX sorted BAM. Allows stdin\n"
+"  -m, --max-mem         Memory (MB) to buffer records in before spilling to a temporary file, with -s. Default: 768\n"
+"  -T, --tmp             Prefix for temporary files, with -s. Default: bxconvert\n"
 "\n";
 
 namespace opt {
@@ -27,84 +38,139 @@ namespace opt {
   static std::string bam;
   static bool keeptags = false;
   static std::string tag = "BX";
+  static bool sort = false; // one pass with an external sort
+  static size_t max_mem = 768; // MB
+  static std::string tmp = "bxconvert";
 }
 
-static const char* shortopts = "hvkt:";
+static const char* shortopts = "hvkst:m:T:";
 static const struct option longopts[] = {
   { "help",                    no_argument, NULL, 'h' },
   { "verbose",                 no_argument, NULL, 'v' },
   { "keep-tags",               no_argument, NULL, 'k' },
   { "tag",                     required_argument, NULL, 't' },
+  { "sort",                    no_argument, NULL, 's' },
+  { "max-mem",                 required_argument, NULL, 'm' },
+  { "tmp",                     required_argument, NULL, 'T' },
   { NULL, 0, NULL, 0 }
 };
 
-static void read_bx(std::string& bx, const SeqLib::BamRecord& r);
+static BXID read_bx(BXDict& dict, BXAux& aux, const SeqLib::BamRecord& r);
+// reference names in use: tags with a "_", noted up front, and the names
+// tags with "-" were renamed to so far. A rename must not land on any of them
+typedef std::unordered_set<std::string> BXNameSet;
+static void noteName(BXNameSet& taken, const char* bx, size_t len);
+static void noteName(BXNameSet& taken, const BXDict& dict, BXID id);
+static void appendSQ(std::string& text, const char* bx, size_t len, BXNameSet& taken);
+static void appendSQ(std::string& text, const BXDict& dict, BXID id, BXNameSet& taken);
+static void runSortedConvert();
 static const std::string empty_tag = "Empty";
 
 void runConvert(int argc, char** argv) {
 
     parseOptions(argc, argv);
 
-    SeqLib::BamReader reader;
+    if (opt::sort) {
+      runSortedConvert();
+      return;
+    }
+
+    SeqLib::BamReader reader, reader2;
     BXOPEN(reader, opt::bam);
     SeqLib::BamHeader hdr = reader.Header();
     
     SeqLib::BamRecord r;
     SeqLib::BamWriter w;
     size_t count = 0, unique_bx = 0;
-    std::string bx;
-    std::unordered_map<std::string, size_t> bxtags;
-    std::stringstream ss;
+    BXAux aux(opt::tag.c_str());
+    const BXDictFile* file = bxtools::GetDict();
+    BXDict dict(file);
+    std::unordered_map<BXID, size_t, BXHash> bxtags;
+    std::string text = "@HD\tVN:1.4  GO:none\tSO:unsorted\n";
+    BXNameSet taken;
+    SeqLib::BamReader* in = &reader;
+    size_t empty_tid = 0; // with a dictionary, where reads without a known tag go
 
-    if (opt::bam.compare("-") == 0){
-      std::cerr << "Cant accept standard input as file" << std::endl;
-      exit(EXIT_FAILURE);
-    }
+    if (file) {
+      // the dictionary gives the sequences up front, one per barcode by ID and
+      // then Empty, so there is no first pass and stdin is fine
+      for (size_t i = 0; i < file->size(); ++i)
+	noteName(taken, file->Name(i), file->NameLength(i));
+      text.reserve(text.size() + file->size() * 32);
+      for (size_t i = 0; i < file->size(); ++i)
+	appendSQ(text, file->Name(i), file->NameLength(i), taken);
+      const int64_t e = file->Find(empty_tag.data(), empty_tag.size());
+      empty_tid = e >= 0 ? e : file->size();
+      if (e < 0)
+	appendSQ(text, empty_tag.data(), empty_tag.size(), taken);
+      unique_bx = file->size();
+    } else {
 
-    if (opt::verbose)
-      std::cerr << "...starting first pass to tally unique " << opt::tag << " tags" << std::endl;
-
-    // Loop through file once to grab all BX tags and store in string to generate header
-    ss << "@HD" << "\t" << "VN:1.4" << "  " << "GO:none\tSO:unsorted" << std::endl;  
-    while (reader.GetNextRecord(r)){
-      read_bx(bx, r);
-
-      BXLOOPCHECK(r, unique_bx > 1, opt::tag)
-      if (!bxtags.count(bx)) {
-        bxtags.insert(std::pair<std::string, size_t>(bx, unique_bx));
-	++unique_bx;      
-	ss << "@SQ" << "\t" << "SN:" << bx << "\t" << "LN:1" << std::endl;
-      }    
+      if (opt::bam.compare("-") == 0){
+	std::cerr << "Cant accept standard input as file" << std::endl;
+	exit(EXIT_FAILURE);
+      }
+
+      if (opt::verbose)
+	std::cerr << "...starting first pass to tally unique " << opt::tag << " tags" << std::endl;
+
+      // Loop through file once to grab all BX tags, then build the header
+      std::vector<BXID> order;
+      while (BXNextRecord(reader, r)){
+	const BXID id = read_bx(dict, aux, r);
+
+	BXLOOPCHECK(r, unique_bx > 1, opt::tag)
+	if (!bxtags.count(id)) {
+	  bxtags.insert(std::pair<BXID, size_t>(id, unique_bx));
+	  ++unique_bx;      
+	  order.push_back(id);
+	  noteName(taken, dict, id);
+	}    
       
+      }
+      for (const auto& id : order)
+	appendSQ(text, dict, id, taken);
+
+      //Loop through the BAM file again
+      reader.Close();
+      BXOPEN(reader2, opt::bam);
+      in = &reader2;
+      count = 0;
     }
-    //write new header based on string generated from BX tags
-    SeqLib::BamHeader bxbamheader (ss.str());
+    //write new header based on the BX tags
+    SeqLib::BamHeader bxbamheader(text);
+    text = std::string();
 
     if (opt::verbose) 
       std::cerr << "Found " << unique_bx << " unique barcodes" << std::endl;
 
     w.Open("-");
+    BXTHREADS(w)
     w.SetHeader(bxbamheader);
     w.WriteHeader();
     
-    //Loop through the BAM file again
-    reader.Close();
-    SeqLib::BamReader reader2;
-    BXOPEN(reader2, opt::bam);
-    
     if (opt::verbose)
-      std::cerr << "...starting second pass to flip chr and BX" << std::endl;
+      std::cerr << "...starting " << (file ? "" : "second ") << "pass to flip chr and BX" << std::endl;
 
-    while (reader2.GetNextRecord(r)) {
+    const BXID empty_id = dict.Encode(empty_tag);
+    size_t unknown = 0; // reads with a barcode not in the dictionary
+    while (BXNextRecord(*in, r)) {
 
       if (opt::keeptags) {
 	r.AddZTag("CR", r.ChrID() >= 0 ? hdr.IDtoName(r.ChrID()) : "*");
 	r.AddIntTag("POS", r.Position());
       }
 
-      read_bx(bx, r); // read the BX tag. Set default if not present
+      const BXID id = read_bx(dict, aux, r); // read the BX tag. Set default if not present
       BXLOOPCHECK(r, true, opt::tag) // read and check we have a BX
-      r.SetChrID(bxtags[bx]);
+      if (!file) {
+	r.SetChrID(bxtags[id]);
+      } else if (BXDict::IsDict(id)) {
+	r.SetChrID(id & ~BXDict::DICT);
+      } else {
+	r.SetChrID(empty_tid);
+	unknown += id != empty_id;
+      }
       r.SetChrIDMate(-1);
       r.SetPosition(0);
       if (!opt::keeptags)
@@ -113,6 +179,10 @@ void runConvert(int argc, char** argv) {
       w.WriteRecord(r);
     }
     w.Close();
+
+    if (unknown)
+      std::cerr << SeqLib::AddCommas(unknown) << " reads had a " << opt::tag << " not in the dictionary, and went to "
+		<< empty_tag << std::endl;
   }
 
 
@@ -136,6 +206,9 @@ void parseOptions(int argc, char** argv) {
       case 'h': help = true; break;
       case 'k': opt::keeptags = true; break;
       case 't': arg >> opt::tag;  break;
+      case 's': opt::sort = true; break;
+      case 'm': arg >> opt::max_mem; break;
+      case 'T': arg >> opt::tmp; break;
       }
     }
 
@@ -147,9 +220,138 @@ void parseOptions(int argc, char** argv) {
 
 }
 
-static void read_bx(std::string& bx, const SeqLib::BamRecord& r) {
-  if (!r.GetZTag(opt::tag, bx))
-    bx = empty_tag;
-  std::replace(bx.begin(), bx.end(), '-', '_');
-  assert(!bx.empty());
+// Single pass convert. Records are flipped as they are read and fed to an external
+// sort keyed on the tag. Once the input is exhausted the header is built from the
+// sorted set of tags, so chromosome IDs ascend with the merge and the output is
+// coordinate sorted and can be indexed directly
+static void runSortedConvert() {
+
+  SeqLib::BamReader reader;
+  BXOPEN(reader, opt::bam);
+  SeqLib::BamHeader hdr = reader.Header();
+
+  BXSorter sorter(opt::max_mem << 20, opt::tmp);
+  BXDict dict(bxtools::GetDict());
+  std::unordered_set<BXID, BXHash> bxtags;
+  
+  SeqLib::BamRecord r;
+  size_t count = 0;
+  BXAux aux(opt::tag.c_str());
+
+  if (opt::verbose)
+    std::cerr << "...reading and buffering records by " << opt::tag << " tag" << std::endl;
+
+  while (BXNextRecord(reader, r)) {
+
+    if (opt::keeptags) {
+      r.AddZTag("CR", r.ChrID() >= 0 ? hdr.IDtoName(r.ChrID()) : "*");
+      r.AddIntTag("POS", r.Position());
+    }
+
+    const BXID id = read_bx(dict, aux, r);
+    BXLOOPCHECK(r, bxtags.size() > 1, opt::tag)
+    bxtags.insert(id);
+
+    r.SetChrIDMate(-1);
+    r.SetPosition(0);
+    if (!opt::keeptags)
+      r.RemoveAllTags();
+    // sort on the big-endian ID, so byte order matches numeric order
+    char key[sizeof(BXID)];
+    for (size_t i = 0; i < sizeof(BXID); ++i)
+      key[i] = (id >> (8 * (sizeof(BXID) - 1 - i))) & 0xff;
+    sorter.Add(key, sizeof(BXID), r.raw());
+  }
+
+  std::vector<BXID> sorted(bxtags.begin(), bxtags.end());
+  bxtags.clear();
+  std::sort(sorted.begin(), sorted.end());
+
+  if (opt::verbose) 
+    std::cerr << "Found " << sorted.size() << " unique barcodes in " << 
+      SeqLib::AddCommas(sorter.NumRecords()) << " reads, spilled to " << sorter.NumRuns() << " temporary files" << std::endl;
+
+  BXNameSet taken;
+  for (const auto& b : sorted)
+    noteName(taken, dict, b);
+  std::string text = "@HD\tVN:1.4\tSO:coordinate\n";
+  for (const auto& b : sorted)
+    appendSQ(text, dict, b, taken);
+  SeqLib::BamHeader bxbamheader(text);
+  text = std::string();
+  
+  SeqLib::BamWriter w;
+  w.Open("-");
+  BXTHREADS(w)
+  w.SetHeader(bxbamheader);
+  w.WriteHeader();
+
+  if (opt::verbose)
+    std::cerr << "...merging and writing BX sorted output" << std::endl;
+
+  // keys come back in sorted order, so the ID is the index of the current key
+  int32_t tid = -1;
+  std::string last;
+  SeqLib::BamRecord out;
+  out.init();
+  sorter.Merge([&](const std::string& key, bam1_t* b) {
+      if (tid < 0 || key != last) {
+	last = key;
+	++tid;
+      }
+      b->core.tid = tid;
+      bam_copy1(out.raw(), b);
+      w.WriteRecord(out);
+    });
+  w.Close();
+}
+
+static BXID read_bx(BXDict& dict, BXAux& aux, const SeqLib::BamRecord& r) {
+  BXStrRef bx;
+  if (!aux.Scan(r.raw()) || !aux.Z(0, bx) || bx.empty())
+    return dict.Encode(empty_tag);
+  return dict.Encode(bx.data, bx.size);
+}
+
+static void noteName(BXNameSet& taken, const char* bx, size_t len) {
+  if (memchr(bx, '_', len))
+    taken.insert(std::string(bx, len));
+}
+
+static void noteName(BXNameSet& taken, const BXDict& dict, BXID id) {
+  if (BXDict::IsPacked(id))
+    return; // only bases, digits and "-"
+  const std::string bx = dict.Decode(id);
+  noteName(taken, bx.data(), bx.size());
+}
+
+// switch "-" for "_" in the name at the end of text, so it can be queried
+// with samtools, unless that gives the name of another tag or of an earlier
+// rename, which would make two references of one name. Such a tag keeps its
+// "-", and no name in use has one, so it stays unique
+static void renameSQ(std::string& text, size_t start, BXNameSet& taken) {
+  if (std::find(text.begin() + start, text.end(), '-') == text.end())
+    return;
+  std::string renamed = text.substr(start);
+  std::replace(renamed.begin(), renamed.end(), '-', '_');
+  if (!taken.insert(renamed).second)
+    return;
+  std::replace(text.begin() + start, text.end(), '-', '_');
+}
+
+// add the reference line for a tag to header text
+static void appendSQ(std::string& text, const char* bx, size_t len, BXNameSet& taken) {
+  text += "@SQ\tSN:";
+  const size_t start = text.size();
+  text.append(bx, len);
+  renameSQ(text, start, taken);
+  text += "\tLN:1\n";
+}
+
+static void appendSQ(std::string& text, const BXDict& dict, BXID id, BXNameSet& taken) {
+  text += "@SQ\tSN:";
+  const size_t start = text.size();
+  dict.Decode(id, text);
+  renameSQ(text, start, taken);
+  text += "\tLN:1\n";
 }
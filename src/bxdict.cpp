@@ -0,0 +1,112 @@
+#include "bxdict.h"
+#include "bxdictfile.h"
+
+static const char BASES[4] = { 'A', 'C', 'G', 'T' };
+
+// 2 bit code for a base, or -1 if it is not ACGT
+static inline int base_code(char c) {
+  switch (c) {
+  case 'A': return 0;
+  case 'C': return 1;
+  case 'G': return 2;
+  case 'T': return 3;
+  default: return -1;
+  }
+}
+
+BXID BXDict::Encode(const char* s, size_t len) {
+
+  if (m_file) {
+    const int64_t i = m_file->Find(s, len);
+    if (i >= 0)
+      return DICT | i;
+  }
+
+  BXID id;
+  if (Pack(s, len, id))
+    return id;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::string key(s, len);
+  auto ff = m_intern.find(key);
+  if (ff != m_intern.end())
+    return ff->second;
+  id = INTERNED | m_strings.size();
+  m_intern.insert(std::make_pair(key, id));
+  m_strings.push_back(key);
+  return id;
+}
+
+bool BXDict::Pack(const char* s, size_t len, BXID& out) {
+
+  // numbers, without leading zeros so they decode to the same string
+  if (len && len <= 16 && s[0] >= '0' && s[0] <= '9' && (s[0] != '0' || len == 1)) {
+    BXID n = 0;
+    size_t i = 0;
+    for (; i < len && s[i] >= '0' && s[i] <= '9'; ++i)
+      n = n * 10 + (s[i] - '0');
+    if (i == len) {
+      out = NUMERIC | n;
+      return true;
+    }
+  }
+  
+  // try to pack it
+  BXID id = 0;
+  size_t i = 0;
+  for (; i < len && i < 24; ++i) {
+    int c = base_code(s[i]);
+    if (c < 0)
+      break;
+    id |= (BXID)c << (2 * i);
+  }
+
+  bool packed = i == len;
+  if (!packed && s[i] == '-' && len - i >= 2 && len - i <= 4 && s[i + 1] != '0') {
+    // GEM group suffix, e.g. -1
+    unsigned gem = 0;
+    packed = true;
+    for (size_t j = i + 1; j < len && packed; ++j) {
+      if (s[j] < '0' || s[j] > '9')
+	packed = false;
+      else
+	gem = gem * 10 + (s[j] - '0');
+    }
+    packed = packed && gem <= 255;
+    if (packed)
+      id |= (BXID)gem << 48;
+  }
+
+  if (packed)
+    out = id | ((BXID)i << 56);
+  return packed;
+}
+
+void BXDict::Decode(BXID id, std::string& out) const {
+
+  if (IsDict(id)) {
+    const uint64_t i = id & ~DICT;
+    out.append(m_file->Name(i), m_file->NameLength(i));
+    return;
+  }
+
+  if (!IsPacked(id)) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    out += m_strings[id & ~INTERNED];
+    return;
+  }
+
+  if (id & NUMERIC) {
+    out += std::to_string(id & ~NUMERIC);
+    return;
+  }
+
+  const size_t len = (id >> 56) & 0x1f;
+  for (size_t i = 0; i < len; ++i)
+    out.push_back(BASES[(id >> (2 * i)) & 3]);
+  const unsigned gem = (id >> 48) & 0xff;
+  if (gem) {
+    out.push_back('-');
+    out += std::to_string(gem);
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef BXTOOLS_BXDICT_H__
+#define BXTOOLS_BXDICT_H__
+
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+// Integer ID for a barcode. 10X style barcodes (up to 24 bp of ACGT with an
+// optional -N GEM group suffix, N in 1-255) are packed directly into the ID:
+//
+//   bits 0-47   sequence, 2 bits per base, first base in the lowest bits
+//   bits 48-55  GEM group N, or 0 if there is no suffix
+//   bits 56-60  sequence length
+//
+// Plain decimal numbers (e.g. MI:i tags) are stored with bit 62 set and the
+// value in the low bits. Anything else is interned and gets bit 63 set, with
+// the index into the intern table in the low bits. Packed IDs never need a lookup to encode or
+// decode, so hot loops can key their maps on BXID instead of std::string.
+//
+// A dictionary made with a barcode file (--dict) gives the barcodes in the
+// file their dense ID there with bit 61 set, so IDs are the same in every run
+// on the library, and only falls back to the above for barcodes not in it
+typedef uint64_t BXID;
+
+class BXDictFile;
+
+// mixes the bits of an ID before bucketing, since packed IDs are not random
+struct BXHash {
+  size_t operator()(BXID x) const {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+  }
+};
+
+class BXDict {
+
+ public:
+
+  static const BXID INTERNED = 1ULL << 63;
+  static const BXID NUMERIC = 1ULL << 62;
+  static const BXID DICT = 1ULL << 61;
+
+  BXDict() {}
+
+  // encode through a barcode file first, if not null. The file must outlive
+  // the dictionary
+  explicit BXDict(const BXDictFile* file) : m_file(file) {}
+
+  BXID Encode(const char* s, size_t len);
+
+  BXID Encode(const std::string& s) { return Encode(s.data(), s.size()); }
+
+  // append the barcode string for an ID to out
+  void Decode(BXID id, std::string& out) const;
+
+  std::string Decode(BXID id) const {
+    std::string out;
+    Decode(id, out);
+    return out;
+  }
+
+  static bool IsPacked(BXID id) { return !(id & (INTERNED | DICT)); }
+
+  // the ID was given by the barcode file, and id & ~DICT is its rank there
+  static bool IsDict(BXID id) { return (id & (INTERNED | DICT)) == DICT; }
+
+  // the packed or numeric ID of a barcode, without interning. Returns false
+  // if it doesn't pack
+  static bool Pack(const char* s, size_t len, BXID& id);
+
+  // packed ID with the GEM group (-N suffix) cleared
+  static BXID StripGEM(BXID id) { return (id & (INTERNED | NUMERIC | DICT)) ? id : id & ~(0xffULL << 48); }
+
+  size_t NumInterned() const { return m_strings.size(); }
+
+  const BXDictFile* File() const { return m_file; }
+  
+ private:
+
+  BXDict(const BXDict&);
+  BXDict& operator=(const BXDict&);
+
+  const BXDictFile* m_file = nullptr;
+
+  // fallback for barcodes that do not pack. Guarded so that worker threads
+  // can share one dictionary
+  std::unordered_map<std::string, BXID> m_intern;
+  std::deque<std::string> m_strings;
+  mutable std::mutex m_mutex;
+
+};
+
+#endif
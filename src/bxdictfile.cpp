@@ -0,0 +1,329 @@
+#include "bxdictfile.h"
+
+#include <getopt.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "SeqLib/BamReader.h"
+#include "SeqLib/SeqLibUtils.h"
+
+#include "bxcommon.h"
+#include "bxprof.h"
+#include "bxaux.h"
+#include "bxdict.h"
+
+namespace opt {
+
+  static std::string bam; // the bam to collect barcodes from
+  static bool verbose = false;
+  static std::string tag = "BX"; // tag with the barcode
+  static std::string output; // the dictionary to write
+  static std::string list; // file of barcodes to add
+  static size_t min = 1; // reads a barcode needs to make it in
+}
+
+static const char* shortopts = "hvt:o:f:m:";
+static const struct option longopts[] = {
+  { "help",                    no_argument, NULL, 'h' },
+  { "verbose",                 no_argument, NULL, 'v' },
+  { "tag",                     required_argument, NULL, 't' },
+  { "output",                  required_argument, NULL, 'o' },
+  { "file",                    required_argument, NULL, 'f' },
+  { "min-reads",               required_argument, NULL, 'm' },
+  { NULL, 0, NULL, 0 }
+};
+
+static const char *DICT_USAGE_MESSAGE =
+"Usage: bxtools dict [BAM] -o library.bxd\n"
+"Description: Write a barcode dictionary of a library, for later runs to map with --dict\n"
+"\n"
+"  General options\n"
+"  -v, --verbose         Set verbose output\n"
+"  -o, --output          Dictionary file to write [required]\n"
+"  -t, --tag             Tag to collect barcodes from [BX]\n"
+"  -m, --min-reads       Leave out barcodes of the BAM with fewer reads than this [1]\n"
+"  -f, --file            Add the barcodes in this file, one per line. The BAM may then be left out\n"
+"\n";
+
+static const char DICT_MAGIC[8] = { 'B', 'X', 'D', 'I', 'C', 1, 0, 0 };
+
+static void parseOptions(int argc, char** argv);
+
+static inline uint64_t mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// 64 bit hash of a barcode, eight bytes at a time
+static uint64_t hashBarcode(const char* s, size_t len, uint64_t seed) {
+  uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+  for (; len >= 8; s += 8, len -= 8) {
+    uint64_t w;
+    memcpy(&w, s, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  if (len) {
+    uint64_t w = 0;
+    memcpy(&w, s, len);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+  }
+  return mix(h);
+}
+
+static inline uint64_t bucketOf(uint64_t h, uint64_t nb) { return (h >> 32) % nb; }
+
+static inline uint64_t slotOf(uint64_t h, uint64_t d, uint64_t n) { return mix(h + d * 0x9e3779b97f4a7c15ULL) % n; }
+
+// find a displacement for each bucket, largest buckets first, while most
+// slots are still free. Returns false if a bucket can't be placed, to try
+// again with another seed
+static bool placeBuckets(const std::vector<std::string>& bxs, uint64_t seed,
+			 std::vector<uint32_t>& disp, std::vector<uint32_t>& slots) {
+
+  const uint64_t n = bxs.size(), nb = disp.size();
+  std::vector<uint64_t> hashes(n);
+  std::vector<uint32_t> start(nb + 1, 0);
+  for (uint64_t i = 0; i < n; ++i) {
+    hashes[i] = hashBarcode(bxs[i].data(), bxs[i].size(), seed);
+    ++start[bucketOf(hashes[i], nb) + 1];
+  }
+  for (uint64_t b = 0; b < nb; ++b)
+    start[b + 1] += start[b];
+  std::vector<uint32_t> keys(n), fill(start.begin(), start.end() - 1);
+  for (uint64_t i = 0; i < n; ++i)
+    keys[fill[bucketOf(hashes[i], nb)]++] = i;
+
+  std::vector<uint32_t> order(nb);
+  for (uint64_t b = 0; b < nb; ++b)
+    order[b] = b;
+  std::sort(order.begin(), order.end(), [&start](uint32_t a, uint32_t b) {
+      return start[a + 1] - start[a] > start[b + 1] - start[b];
+    });
+
+  std::vector<bool> taken(n, false);
+  std::vector<uint64_t> pos;
+  for (const auto& b : order) {
+    if (start[b + 1] == start[b])
+      break; // the rest are empty too
+    uint64_t d = 0;
+    for (;; ++d) {
+      if (d > UINT32_MAX)
+	return false;
+      pos.clear();
+      uint32_t k = start[b];
+      for (; k < start[b + 1]; ++k) {
+	const uint64_t p = slotOf(hashes[keys[k]], d, n);
+	if (taken[p] || std::find(pos.begin(), pos.end(), p) != pos.end())
+	  break;
+	pos.push_back(p);
+      }
+      if (k == start[b + 1])
+	break;
+    }
+    disp[b] = d;
+    for (size_t i = 0; i < pos.size(); ++i) {
+      taken[pos[i]] = true;
+      slots[pos[i]] = keys[start[b] + i];
+    }
+  }
+  return true;
+}
+
+BXDictFile::~BXDictFile() {
+  if (m_base)
+    munmap((void*)m_base, m_size);
+}
+
+bool BXDictFile::Open(const std::string& fn) {
+
+  int fd = open(fn.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BXDictHeader)) {
+    close(fd);
+    return false;
+  }
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+  m_base = (const char*)p;
+  m_size = st.st_size;
+
+  memcpy(&m_hdr, m_base, sizeof(m_hdr));
+  if (memcmp(m_hdr.magic, DICT_MAGIC, sizeof(DICT_MAGIC)) || !m_hdr.n_buckets ||
+      m_hdr.off_offsets < sizeof(BXDictHeader) + (m_hdr.n_buckets + m_hdr.n) * sizeof(uint32_t) ||
+      m_hdr.off_names < m_hdr.off_offsets + (m_hdr.n + 1) * sizeof(uint64_t) || m_hdr.off_names > m_size)
+    return false;
+  m_disp = (const uint32_t*)(m_base + sizeof(BXDictHeader));
+  m_slots = m_disp + m_hdr.n_buckets;
+  m_offs = (const uint64_t*)(m_base + m_hdr.off_offsets);
+  m_names = m_base + m_hdr.off_names;
+  return m_hdr.off_names + m_offs[m_hdr.n] <= m_size;
+}
+
+int64_t BXDictFile::Find(const char* s, size_t len) const {
+  if (!m_hdr.n)
+    return -1;
+  const uint64_t h = hashBarcode(s, len, m_hdr.seed);
+  const uint32_t id = m_slots[slotOf(h, m_disp[bucketOf(h, m_hdr.n_buckets)], m_hdr.n)];
+  if (NameLength(id) != len || memcmp(Name(id), s, len))
+    return -1;
+  return id;
+}
+
+bool BXDictFile::Write(const std::string& fn, const std::vector<std::string>& barcodes) {
+
+  for (size_t i = 1; i < barcodes.size(); ++i)
+    if (!(barcodes[i - 1] < barcodes[i]))
+      return false;
+
+  // about four barcodes per bucket
+  BXDictHeader h;
+  memcpy(h.magic, DICT_MAGIC, sizeof(DICT_MAGIC));
+  h.n = barcodes.size();
+  h.n_buckets = std::max(h.n / 4, (uint64_t)1);
+  std::vector<uint32_t> disp(h.n_buckets, 0), slots(h.n, 0);
+  for (h.seed = 1; !placeBuckets(barcodes, h.seed, disp, slots); ++h.seed)
+    std::fill(disp.begin(), disp.end(), 0);
+
+  std::vector<uint64_t> offs;
+  offs.reserve(h.n + 1);
+  uint64_t off = 0;
+  for (const auto& b : barcodes) {
+    offs.push_back(off);
+    off += b.size() + 1;
+  }
+  offs.push_back(off);
+
+  // the offsets are 8 byte aligned, so they can be read in place
+  const uint64_t head = sizeof(h) + (h.n_buckets + h.n) * sizeof(uint32_t);
+  const uint64_t pad = (8 - head % 8) % 8;
+  h.off_offsets = head + pad;
+  h.off_names = h.off_offsets + offs.size() * sizeof(uint64_t);
+
+  FILE* out = fopen(fn.c_str(), "wb");
+  if (!out)
+    return false;
+  const char zeros[8] = { 0 };
+  bool ok = fwrite(&h, sizeof(h), 1, out) == 1 &&
+    fwrite(disp.data(), sizeof(uint32_t), disp.size(), out) == disp.size() &&
+    fwrite(slots.data(), sizeof(uint32_t), slots.size(), out) == slots.size() &&
+    fwrite(zeros, 1, pad, out) == pad &&
+    fwrite(offs.data(), sizeof(uint64_t), offs.size(), out) == offs.size();
+  for (size_t i = 0; ok && i < barcodes.size(); ++i)
+    ok = fwrite(barcodes[i].c_str(), 1, barcodes[i].size() + 1, out) == barcodes[i].size() + 1;
+  return fclose(out) == 0 && ok;
+}
+
+void runDict(int argc, char** argv) {
+
+  parseOptions(argc, argv);
+
+  std::vector<std::string> barcodes;
+
+  if (!opt::list.empty()) {
+    std::ifstream in(opt::list);
+    if (!in) {
+      std::cerr << "Could not read barcodes from " << opt::list << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+      while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+	line.pop_back();
+      if (!line.empty())
+	barcodes.push_back(line);
+    }
+    if (opt::verbose)
+      std::cerr << "Read " << SeqLib::AddCommas(barcodes.size()) << " barcodes from " << opt::list << std::endl;
+  }
+
+  if (!opt::bam.empty()) {
+
+    SeqLib::BamReader reader;
+    BXOPEN(reader, opt::bam);
+
+    SeqLib::BamRecord r;
+    size_t count = 0;
+    BXAux aux(opt::tag.c_str());
+    BXDict dict;
+    std::unordered_map<BXID, size_t, BXHash> counts;
+    while (BXNextRecord(reader, r)) {
+      BXStrRef bx;
+      const bool found = aux.Scan(r.raw()) && aux.Text(0, bx) && !bx.empty();
+      BXLOOPCHECK(r, !counts.empty(), opt::tag)
+      if (found)
+	++counts[dict.Encode(bx.data, bx.size)];
+    }
+    bxtools::Profile().Map("dict.barcodes", counts);
+
+    size_t kept = 0;
+    for (const auto& c : counts)
+      if (c.second >= opt::min) {
+	barcodes.push_back(dict.Decode(c.first));
+	++kept;
+      }
+    if (opt::verbose)
+      std::cerr << "Found " << SeqLib::AddCommas(counts.size()) << " barcodes in " << SeqLib::AddCommas(count)
+		<< " reads, " << SeqLib::AddCommas(kept) << " with at least " << opt::min << " reads" << std::endl;
+  }
+
+  std::sort(barcodes.begin(), barcodes.end());
+  barcodes.erase(std::unique(barcodes.begin(), barcodes.end()), barcodes.end());
+
+  if (!BXDictFile::Write(opt::output, barcodes)) {
+    std::cerr << "Failed writing dictionary " << opt::output << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (opt::verbose)
+    std::cerr << "Wrote " << SeqLib::AddCommas(barcodes.size()) << " barcodes to " << opt::output << std::endl;
+}
+
+static void parseOptions(int argc, char** argv) {
+
+  bool die = false;
+  bool help = false;
+
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v': opt::verbose = true; break;
+    case 'h': help = true; break;
+    case 't': arg >> opt::tag; break;
+    case 'o': arg >> opt::output; break;
+    case 'f': arg >> opt::list; break;
+    case 'm': arg >> opt::min; break;
+    }
+  }
+
+  if (optind < argc)
+    opt::bam = argv[optind];
+
+  if (opt::bam.empty() && opt::list.empty())
+    die = true;
+  if (!help && opt::output.empty()) {
+    std::cerr << "dict needs an output file (-o)" << std::endl;
+    die = true;
+  }
+
+  if (die || help) {
+    std::cerr << "\n" << DICT_USAGE_MESSAGE;
+    die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
+  }
+}
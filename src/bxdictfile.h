@@ -0,0 +1,73 @@
+#ifndef BXTOOLS_BXDICTFILE_H__
+#define BXTOOLS_BXDICTFILE_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+void runDict(int argc, char** argv);
+
+// Barcode dictionary (.bxd) written by "bxtools dict" and given to later runs
+// with --dict. The barcodes of a library are stored sorted, and a barcode's
+// dense ID is its rank. Lookup goes through a minimal perfect hash (hash and
+// displace: the key's bucket holds a displacement that sends every key of
+// the bucket to its own slot), then one string compare to reject barcodes
+// that are not in the set. Layout:
+//
+//   BXDictHeader
+//   disp         n_buckets uint32 displacements
+//   slots        n uint32, the ID of the barcode hashed to each slot
+//   offsets      n + 1 uint64 offsets of the names, at off_offsets
+//   names        NUL terminated barcodes in ID (sorted) order
+//
+// Little endian, and read in place from a memory map, so jobs on one node
+// share a single copy through the page cache
+struct BXDictHeader {
+  char magic[8];
+  uint64_t n;
+  uint64_t n_buckets;
+  uint64_t seed;
+  uint64_t off_offsets;
+  uint64_t off_names;
+};
+
+class BXDictFile {
+
+ public:
+
+  BXDictFile() {}
+
+  ~BXDictFile();
+
+  bool Open(const std::string& fn);
+
+  // number of barcodes
+  size_t size() const { return m_hdr.n; }
+
+  // the ID of a barcode, or -1 if it is not in the dictionary
+  int64_t Find(const char* s, size_t len) const;
+
+  const char* Name(uint64_t id) const { return m_names + m_offs[id]; }
+
+  size_t NameLength(uint64_t id) const { return m_offs[id + 1] - m_offs[id] - 1; }
+
+  // write a dictionary. Barcodes must be sorted and distinct
+  static bool Write(const std::string& fn, const std::vector<std::string>& barcodes);
+
+ private:
+
+  BXDictFile(const BXDictFile&);
+  BXDictFile& operator=(const BXDictFile&);
+
+  const char* m_base = nullptr;
+  size_t m_size = 0;
+  BXDictHeader m_hdr;
+  const uint32_t* m_disp = nullptr;
+  const uint32_t* m_slots = nullptr;
+  const uint64_t* m_offs = nullptr;
+  const char* m_names = nullptr;
+
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "bxfilter.h"
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include "htslib/sam.h"
+
+#include "SeqLib/SeqLibUtils.h"
+
+#include "bxcommon.h"
+#include "bxraw.h"
+
+bool BXBarcodeSet::Load(const std::string& fn) {
+
+  std::ifstream in(fn);
+  if (!in)
+    return false;
+  std::string line;
+  while (std::getline(in, line)) {
+    while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+      line.pop_back();
+    if (line.empty())
+      continue;
+    BXID id;
+    if (BXDict::Pack(line.data(), line.size(), id))
+      m_ids.push_back(BXDict::StripGEM(id));
+    else
+      m_other.insert(line);
+  }
+
+  // about four IDs per bucket
+  size_t nb = 1;
+  m_shift = 64;
+  while (nb * 4 < m_ids.size()) {
+    nb <<= 1;
+    --m_shift;
+  }
+  std::sort(m_ids.begin(), m_ids.end(), [this](BXID a, BXID b) {
+      const size_t ba = bucket(a), bb = bucket(b);
+      return ba < bb || (ba == bb && a < b);
+    });
+  m_ids.erase(std::unique(m_ids.begin(), m_ids.end()), m_ids.end());
+  m_dir.assign(nb + 1, 0);
+  for (const auto& id : m_ids)
+    ++m_dir[bucket(id) + 1];
+  for (size_t i = 0; i < nb; ++i)
+    m_dir[i + 1] += m_dir[i];
+  return true;
+}
+
+bool BXBarcodeSet::Contains(const char* s, size_t len) const {
+  BXID id;
+  if (!BXDict::Pack(s, len, id))
+    return m_other.count(std::string(s, len));
+  id = BXDict::StripGEM(id);
+  const size_t b = bucket(id);
+  for (uint32_t i = m_dir[b]; i < m_dir[b + 1]; ++i)
+    if (m_ids[i] == id)
+      return true;
+  return false;
+}
+
+BXCountMin::BXCountMin(size_t bytes, int depth) : m_depth(depth) {
+  m_width = std::max(bytes / depth, (size_t)1024);
+  m_counts.assign(m_width * depth, 0);
+}
+
+// one cell per row, from two halves of a 64 bit hash
+void BXCountMin::cells(const char* s, size_t len, size_t* out) const {
+  uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+  for (size_t i = 0; i < len; ++i) {
+    h ^= (unsigned char)s[i];
+    h *= 0x100000001b3ULL;
+  }
+  h = BXHash()(h);
+  const uint64_t h1 = h & 0xffffffff;
+  const uint64_t h2 = (h >> 32) | 1;
+  for (int i = 0; i < m_depth; ++i)
+    out[i] = i * m_width + (h1 + i * h2) % m_width;
+}
+
+void BXCountMin::Add(const char* s, size_t len) {
+  size_t c[16];
+  cells(s, len, c);
+  uint8_t lo = 255;
+  for (int i = 0; i < m_depth; ++i)
+    lo = std::min(lo, m_counts[c[i]]);
+  if (lo == 255)
+    return;
+  // conservative update: only raise the cells that are at the minimum
+  for (int i = 0; i < m_depth; ++i)
+    if (m_counts[c[i]] == lo)
+      ++m_counts[c[i]];
+}
+
+uint32_t BXCountMin::Estimate(const char* s, size_t len) const {
+  size_t c[16];
+  cells(s, len, c);
+  uint8_t lo = 255;
+  for (int i = 0; i < m_depth; ++i)
+    lo = std::min(lo, m_counts[c[i]]);
+  return lo;
+}
+
+BXFilter::~BXFilter() {
+  delete m_white;
+  delete m_sketch;
+}
+
+void BXFilter::Init(const std::string& whitelist, int min, size_t sketch_mb, 
+		    const std::string& bam, const std::string& tag) {
+
+  if (!whitelist.empty()) {
+    m_white = new BXBarcodeSet();
+    if (!m_white->Load(whitelist)) {
+      std::cerr << "Could not read whitelist " << whitelist << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::cerr << "...loaded " << SeqLib::AddCommas(m_white->size()) << " whitelisted barcodes" << std::endl;
+  }
+
+  if (min <= 1)
+    return;
+  if (bam == "-") {
+    std::cerr << "...reading from stdin, so no --min-reads prefilter" << std::endl;
+    return;
+  }
+  // the counters saturate at 255, so above that the prefilter only drops
+  // what is sure to fail and the exact counts downstream do the rest
+  m_min = std::min(min, 255);
+  if (min > 255)
+    std::cerr << "...--min-reads prefilter cut off at 255 reads" << std::endl;
+  m_sketch = new BXCountMin(sketch_mb << 20);
+
+  // first pass: only the tag is looked at
+  htsFile* fp = sam_open(bam.c_str(), "r");
+  if (!fp) {
+    std::cerr << "Failed to open bam: " << bam << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (bxtools::threads > 1)
+    hts_set_threads(fp, bxtools::threads);
+  bam_hdr_t* hdr = sam_hdr_read(fp);
+  bam1_t* b = bam_init1();
+  char buf[32];
+  size_t count = 0;
+  std::cerr << "...counting barcodes for --min-reads" << std::endl;
+  while (sam_read1(fp, hdr, b) >= 0) {
+    ++count;
+    const char* v = BXTagValue(b, tag.c_str(), buf, sizeof(buf));
+    if (!v)
+      continue;
+    const size_t len = strlen(v);
+    if (!m_white || m_white->Contains(v, len))
+      m_sketch->Add(v, len);
+  }
+  bam_destroy1(b);
+  bam_hdr_destroy(hdr);
+  sam_close(fp);
+  std::cerr << "...counted barcodes of " << SeqLib::AddCommas(count) << " reads" << std::endl;
+}
@@ -0,0 +1,104 @@
+#ifndef BXTOOLS_BXFILTER_H__
+#define BXTOOLS_BXFILTER_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+#include "bxdict.h"
+
+// Static set of barcodes (e.g. the 10X whitelist), ignoring any -N GEM
+// group suffix. Barcodes that pack are kept as a sorted array of IDs, ordered
+// by hash, with a bucket directory on the top bits of the hash, so a lookup
+// is a short scan of about four IDs and the set costs about 9 bytes per
+// barcode. Anything that doesn't pack goes in a plain hash set
+class BXBarcodeSet {
+
+ public:
+
+  BXBarcodeSet() {}
+
+  // read one barcode per line
+  bool Load(const std::string& fn);
+
+  bool Contains(const char* s, size_t len) const;
+
+  size_t size() const { return m_ids.size() + m_other.size(); }
+
+ private:
+
+  int m_shift = 64;
+  std::vector<BXID> m_ids;
+  std::vector<uint32_t> m_dir; // start of each bucket in m_ids, plus the end
+  std::unordered_set<std::string> m_other;
+
+  static uint64_t hash(BXID id) { return BXHash()(id) * 0x9e3779b97f4a7c15ULL; }
+
+  size_t bucket(BXID id) const { return m_shift >= 64 ? 0 : hash(id) >> m_shift; }
+  
+};
+
+// Count-min sketch of barcode counts, with saturating 8 bit counters and
+// conservative update. Estimates are never low
+class BXCountMin {
+
+ public:
+
+  BXCountMin(size_t bytes, int depth = 4);
+
+  void Add(const char* s, size_t len);
+
+  uint32_t Estimate(const char* s, size_t len) const;
+
+ private:
+
+  int m_depth;
+  size_t m_width;
+  std::vector<uint8_t> m_counts;
+
+  void cells(const char* s, size_t len, size_t* out) const;
+  
+};
+
+// Barcode filter shared by split, tile and stats: drop barcodes that are not
+// on a whitelist, and (with min > 0) barcodes seen fewer than min times. The
+// counts come from a count-min sketch filled in a first pass over the BAM,
+// so a barcode that fails never gets a map entry in the main pass. The
+// sketch can over count, so a few barcodes under min may still pass, and its
+// counters stop at 255, so a min above that is applied as 255
+class BXFilter {
+
+ public:
+
+  BXFilter() {}
+
+  ~BXFilter();
+  
+  // load the whitelist (if not empty) and count the barcodes of tag in bam
+  // (if min > 1). The prepass is skipped when reading stdin
+  void Init(const std::string& whitelist, int min, size_t sketch_mb, 
+	    const std::string& bam, const std::string& tag);
+
+  bool Active() const { return m_white || m_sketch; }
+
+  bool Pass(const char* s, size_t len) const {
+    if (m_white && !m_white->Contains(s, len))
+      return false;
+    return !m_sketch || m_sketch->Estimate(s, len) >= (uint32_t)m_min;
+  }
+
+  bool Pass(const std::string& s) const { return Pass(s.data(), s.size()); }
+  
+ private:
+
+  BXFilter(const BXFilter&);
+  BXFilter& operator=(const BXFilter&);
+  
+  BXBarcodeSet* m_white = nullptr;
+  BXCountMin* m_sketch = nullptr;
+  int m_min = 0;
+
+};
+
+#endif
@@ -1,22 +1,27 @@
 #include "bxgroup.h"
 
 #include "bxcommon.h"
+#include "bxprof.h"
+#include "bxaux.h"
+#include "bxdict.h"
 #include <string>
 #include <getopt.h>
 #include <iostream>
 #include <sstream>
+#include <unordered_map>
 
 #include "SeqLib/BamReader.h"
 #include "SeqLib/BamWriter.h"
 
+// the molecule a barcode is currently on
 struct BXGroup {
 
   int start;
   int stop;
-  std::string tag;
-  SeqLib::BamRecordVector buff;
+  int32_t id;
+  int count;
 
-  BXGroup() : start(0), stop(0), tag("MI") {}
+  BXGroup() : start(0), stop(0), id(-1), count(0) {}
 
   int width() const { return stop - start; }
 };
@@ -26,27 +31,98 @@ namespace opt {
   static std::string bam;        // the bam to group
   static bool verbose = false; 
   static std::string tag = "BX"; // tag to group by
+  static std::string out_tag = "MI"; // tag to write the molecule to
+  static int dist = 50000; // max gap between reads of a molecule
 }
 
-static const char* shortopts = "hvxb:a:m:t:";
+static const char* shortopts = "hvt:T:d:";
 static const struct option longopts[] = {
   { "help",                    no_argument, NULL, 'h' },
-  { "no-output",               no_argument, NULL, 'x' },
   { "verbose",                 no_argument, NULL, 'v' },
-  { "min-reads",               required_argument, NULL, 'm' },
   { "tag",                     required_argument, NULL, 't' },
+  { "out-tag",                 required_argument, NULL, 'T' },
+  { "dist",                    required_argument, NULL, 'd' },
   { NULL, 0, NULL, 0 }
 };
 
 static const char *GROUP_USAGE_MESSAGE =
-"Usage: bxtools group <BAM/SAM/CRAM> \n"
-"Description: Group BX tags that are adjacent\n"
+"Usage: bxtools group <BAM/SAM/CRAM> > grouped.bam\n"
+"Description: Group reads with the same BX tag that are adjacent into molecules (input must be coordinate sorted)\n"
 "\n"
 "  General options\n"
 "  -v, --verbose                        Select verbosity level (0-4). Default: 0 \n"
 "  -h, --help                           Display this help and exit\n"
+"  -t, --tag                            Tag to group by [BX]\n"
+"  -T, --out-tag                        Tag to write the (integer) molecule ID to [MI]\n"
+"  -d, --dist                           Start a new molecule when reads of a barcode are more than this far apart [50,000]\n"
 "\n";
 
+// Assigns reads to molecules in one pass over sorted input. Each barcode
+// seen recently on the current chromosome has an open molecule, which is
+// extended by its next read unless that read is more than dist past the
+// molecule's end. Barcodes idle for longer than dist are dropped, so memory
+// is bounded by the barcodes active in a window of the genome
+class BXGrouper {
+
+public:
+
+  BXGrouper(int dist) : m_dist(dist) {}
+
+  // molecule ID for a read of barcode bx on chr:[pos, end]. 
+  // Returns -1 if reads are out of order
+  int32_t Assign(int chr, int pos, int end, BXID bx) {
+
+    if (chr != m_chr) {
+      if (chr < m_chr)
+	return -1;
+      m_groups.clear();
+      m_chr = chr;
+      m_last = pos;
+      m_next_prune = pos + m_dist;
+    }
+    if (pos < m_last)
+      return -1;
+    m_last = pos;
+
+    if (pos > m_next_prune)
+      prune(pos);
+    
+    BXGroup& g = m_groups[bx];
+    if (g.id < 0 || pos - g.stop > m_dist) {
+      g.id = m_next_id++;
+      g.start = pos;
+      g.stop = end;
+      g.count = 0;
+    }
+    g.stop = std::max(g.stop, end);
+    ++g.count;
+    return g.id;
+  }
+
+  int32_t NumMolecules() const { return m_next_id; }
+
+private:
+
+  int m_dist;
+  int m_chr = -1;
+  int m_last = 0;
+  int m_next_prune = 0;
+  int32_t m_next_id = 0;
+  std::unordered_map<BXID, BXGroup, BXHash> m_groups;
+
+  // drop the barcodes that no later read can extend
+  void prune(int pos) {
+    for (auto it = m_groups.begin(); it != m_groups.end();) {
+      if (pos - it->second.stop > m_dist)
+	it = m_groups.erase(it);
+      else
+	++it;
+    }
+    m_next_prune = pos + m_dist;
+  }
+  
+};
+
 static void parseOptions(int argc, char** argv) {
 
   bool die = false;
@@ -63,10 +139,18 @@ static void parseOptions(int argc, char** argv) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v': opt::verbose = true; break;
+    case 'h': help = true; break;
     case 't': arg >> opt::tag; break;
+    case 'T': arg >> opt::out_tag; break;
+    case 'd': arg >> opt::dist; break;
     }
   }
 
+  if (opt::out_tag.length() != 2) {
+    std::cerr << "Output tag should be two characters: " << opt::out_tag << std::endl;
+    die = true;
+  }
+  
   if (die || help) {
     std::cerr << "\n" << GROUP_USAGE_MESSAGE;
     die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
@@ -75,36 +159,61 @@ static void parseOptions(int argc, char** argv) {
 
 void runGroup(int argc, char** argv) {
   
-  std::cerr << "!! NOT YET IMPLEMENTED !!" << std::endl;
-  return;
-  
   parseOptions(argc, argv);
   
   // opeen the BAM
   SeqLib::BamReader reader;
-  if (!reader.Open(opt::bam)) {
-    std::cerr << "Failed to open bam: " << opt::bam << std::endl;
+  BXOPEN(reader, opt::bam);
+
+  // open the write BAM
+  SeqLib::BamWriter w;
+  if (!w.Open("-"))  {
+    std::cerr << "Failed to open output stream" << std::endl;
     exit(EXIT_FAILURE);
   }
+  BXTHREADS(w)
+  w.SetHeader(reader.Header());
+  w.WriteHeader();
+
+  BXDict dict;
+  BXGrouper grouper(opt::dist);
   
   // loop and write
   SeqLib::BamRecord r;
   size_t count = 0;
-  bool hit = false;
-  while (reader.GetNextRecord(r)) {
-
-    ++count;
+  size_t hit = 0;
+  BXAux aux(opt::tag.c_str());
+  BXStrRef bx;
+  while (BXNextRecord(reader, r)) {
 
     // sanity check
     BXLOOPCHECK(r, hit, opt::tag)
 
-    std::string bx;
-    r.GetTag(opt::tag, bx);
-    if (bx.empty()) {
-      continue;
-    } else {
-      hit = true;
+    BXPhaseTimer tag_time(BXPHASE_TAG);
+    if (!aux.Scan(r.raw()) || !aux.Text(0, bx))
+      bx = BXStrRef();
+    tag_time.Stop();
+    if (!bx.empty() && r.MappedFlag()) {
+      ++hit;
+      BXPhaseTimer map_time(BXPHASE_MAP);
+      const int32_t mi = grouper.Assign(r.ChrID(), r.Position(), r.PositionEnd(), dict.Encode(bx.data, bx.size));
+      if (mi < 0) {
+	std::cerr << "Input is not coordinate sorted at read " << r.Brief() << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      r.RemoveTag(opt::out_tag.c_str());
+      r.AddIntTag(opt::out_tag, mi);
     }
     
-  }  
+    BXPhaseTimer write_time(BXPHASE_WRITE);
+    bxtools::Profile().Wrote(sizeof(bam1_core_t) + r.raw()->l_data);
+    if (!w.WriteRecord(r)) {
+      std::cerr << "failed to write read " << r << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  w.Close();
+  std::cerr << "...grouped " << SeqLib::AddCommas(hit) << " reads into " 
+	    << SeqLib::AddCommas(grouper.NumMolecules()) << " molecules" << std::endl;
 }
@@ -0,0 +1,477 @@
+#include "bxindex.h"
+
+#include <getopt.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "htslib/sam.h"
+#include "htslib/bgzf.h"
+
+#include "SeqLib/SeqLibUtils.h"
+#include "SeqLib/BamHeader.h"
+
+#include "bxcommon.h"
+#include "bxprof.h"
+#include "bxdict.h"
+#include "bxvarint.h"
+#include "bxraw.h"
+
+namespace opt {
+
+  static std::string bam; // the bam to index or fetch from
+  static bool verbose = false; 
+  static std::string tag = "BX"; // tag to index by
+  static std::string index; // the sidecar, default <bam>.bxi
+  static std::string list; // file of barcodes to fetch
+}
+
+static const char* shortopts = "hvt:o:i:f:";
+static const struct option longopts[] = {
+  { "help",                    no_argument, NULL, 'h' },
+  { "verbose",                 no_argument, NULL, 'v' },
+  { "tag",                     required_argument, NULL, 't' },
+  { "output",                  required_argument, NULL, 'o' },
+  { "index",                   required_argument, NULL, 'i' },
+  { "file",                    required_argument, NULL, 'f' },
+  { NULL, 0, NULL, 0 }
+};
+
+static const char *INDEX_USAGE_MESSAGE =
+"Usage: bxtools index <BAM> \n"
+"Description: Write a sidecar index (<BAM>.bxi) for looking up reads by BX tag with fetch\n"
+"\n"
+"  General options\n"
+"  -v, --verbose         Set verbose output\n"
+"  -t, --tag             Tag to index by [BX]\n"
+"  -o, --output          Index file to write [<BAM>.bxi]\n"
+"\n";
+
+static const char *FETCH_USAGE_MESSAGE =
+"Usage: bxtools fetch <BAM> <barcode> [barcode ...] > reads.bam\n"
+"Description: Write the reads of some barcodes, using the index from bxtools index\n"
+"             (or the offset table of a BAM from bxtools split -o)\n"
+"\n"
+"  General options\n"
+"  -v, --verbose         Set verbose output\n"
+"  -t, --tag             Tag the index was made on [BX]\n"
+"  -i, --index           Index file [<BAM>.bxi, else <BAM>.bxo]\n"
+"  -f, --file            File of barcodes to fetch, one per line\n"
+"\n";
+
+static const char INDEX_MAGIC[8] = { 'B', 'X', 'I', 'D', 'X', 1, 0, 0 };
+static const char OFFSET_MAGIC[8] = { 'B', 'X', 'O', 'F', 'F', 1, 0, 0 };
+
+static std::vector<std::string> parseOptions(int argc, char** argv, const char* usage);
+
+static htsFile* openBAM(const std::string& fn, bam_hdr_t*& hdr) {
+  htsFile* fp = sam_open(fn.c_str(), "r");
+  if (!fp) {
+    std::cerr << "Failed to open bam: " << fn << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (hts_get_format(fp)->format != bam) {
+    std::cerr << fn << " is not a BAM. Only BGZF compressed BAM files can be indexed" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (bxtools::threads > 1)
+    hts_set_threads(fp, bxtools::threads);
+  hdr = sam_hdr_read(fp);
+  if (!hdr) {
+    std::cerr << "Failed to read header of " << fn << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return fp;
+}
+
+// the blocks of one barcode, while indexing
+struct BXBlockList {
+  std::string data;
+  int64_t last = 0; // last block added
+  uint64_t n = 0;
+};
+
+static void writeOrDie(FILE* fp, const void* p, size_t n) {
+  if (fwrite(p, 1, n, fp) != n) {
+    std::cerr << "Failed writing index " << opt::index << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+void runIndex(int argc, char** argv) {
+
+  parseOptions(argc, argv, INDEX_USAGE_MESSAGE);
+  
+  bam_hdr_t* hdr;
+  htsFile* fp = openBAM(opt::bam, hdr);
+  bam1_t* b = bam_init1();
+
+  BXDict dict;
+  std::unordered_map<BXID, BXBlockList, BXHash> lists;
+  char buf[32];
+  size_t count = 0;
+  int ret;
+  for (;;) {
+    const int64_t voff = bgzf_tell(fp->fp.bgzf);
+    if ((ret = sam_read1(fp, hdr, b)) < 0)
+      break;
+    bxtools::Profile().Read(sizeof(bam1_core_t) + b->l_data);
+    if (++count % 1000000 == 0 && opt::verbose)
+      std::cerr << "...at read " << SeqLib::AddCommas(count) << std::endl;
+
+    const char* v = BXTagValue(b, opt::tag.c_str(), buf, sizeof(buf));
+    if (!v || !*v)
+      continue;
+    BXBlockList& l = lists[dict.Encode(v, strlen(v))];
+    const int64_t block = voff >> 16;
+    if (l.n && l.last == block)
+      continue;
+    BXPutVarint(l.data, block - l.last);
+    BXPutVarint(l.data, voff & 0xffff);
+    l.last = block;
+    ++l.n;
+  }
+  if (ret < -1) {
+    std::cerr << "Failed reading " << opt::bam << " after " << SeqLib::AddCommas(count) << " reads" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  bam_destroy1(b);
+  bam_hdr_destroy(hdr);
+  sam_close(fp);
+
+  // packed IDs sort as numbers, the rest by name
+  std::vector<BXID> packed;
+  std::vector<std::pair<std::string, BXID> > named;
+  for (const auto& l : lists)
+    if (BXDict::IsPacked(l.first))
+      packed.push_back(l.first);
+    else
+      named.push_back(std::make_pair(dict.Decode(l.first), l.first));
+  std::sort(packed.begin(), packed.end());
+  std::sort(named.begin(), named.end());
+
+  BXIndexHeader h;
+  memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  h.n_packed = packed.size();
+  h.n_named = named.size();
+  h.off_names = sizeof(h) + (h.n_packed + h.n_named) * sizeof(BXIndexEntry);
+  h.off_data = h.off_names;
+  for (const auto& n : named)
+    h.off_data += n.first.size() + 1;
+  
+  FILE* out = fopen(opt::index.c_str(), "wb");
+  if (!out) {
+    std::cerr << "Could not open index " << opt::index << " for writing" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  writeOrDie(out, &h, sizeof(h));
+  uint64_t data = 0;
+  auto entry = [&](uint64_t key, BXID id) {
+    const BXBlockList& l = lists[id];
+    BXIndexEntry e;
+    e.key = key;
+    e.off = data;
+    e.n = l.n;
+    writeOrDie(out, &e, sizeof(e));
+    data += l.data.size();
+  };
+  for (const auto& id : packed)
+    entry(id, id);
+  uint64_t name = 0;
+  for (const auto& n : named) {
+    entry(name, n.second);
+    name += n.first.size() + 1;
+  }
+  for (const auto& n : named)
+    writeOrDie(out, n.first.c_str(), n.first.size() + 1);
+  for (const auto& id : packed)
+    writeOrDie(out, lists[id].data.data(), lists[id].data.size());
+  for (const auto& n : named)
+    writeOrDie(out, lists[n.second].data.data(), lists[n.second].data.size());
+  if (fclose(out) != 0) {
+    std::cerr << "Failed writing index " << opt::index << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  std::cerr << "...indexed " << SeqLib::AddCommas(count) << " reads with " 
+	    << SeqLib::AddCommas(lists.size()) << " barcodes" << std::endl;
+}
+
+static void writeRead(htsFile* out, bam_hdr_t* hdr, bam1_t* b) {
+  if (sam_write1(out, hdr, b) < 0) {
+    std::cerr << "Failed to write read " << bam_get_qname(b) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+// the reads of bx are one run of records: one seek, then read to the end
+static size_t fetchRange(const BXOffsets& offsets, const std::string& bx, htsFile* fp, 
+			 bam_hdr_t* hdr, bam1_t* b, htsFile* out) {
+  BXOffsetEntry e;
+  if (!offsets.Lookup(bx, e)) {
+    if (opt::verbose)
+      std::cerr << "...no reads for " << bx << std::endl;
+    return 0;
+  }
+  if (bgzf_seek(fp->fp.bgzf, e.begin, SEEK_SET) < 0) {
+    std::cerr << "Failed to seek in " << opt::bam << " (is the offset table from another file?)" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  size_t n = 0;
+  for (; n < e.n && sam_read1(fp, hdr, b) >= 0; ++n)
+    writeRead(out, hdr, b);
+  return n;
+}
+
+void runFetch(int argc, char** argv) {
+
+  std::vector<std::string> barcodes = parseOptions(argc, argv, FETCH_USAGE_MESSAGE);
+  if (!opt::list.empty()) {
+    std::ifstream in(opt::list);
+    if (!in) {
+      std::cerr << "Could not open barcode list " << opt::list << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::string line;
+    while (std::getline(in, line))
+      if (!line.empty())
+	barcodes.push_back(line);
+  }
+
+  // fetch each barcode once, in the order first asked for
+  std::unordered_set<std::string> seen;
+  barcodes.erase(std::remove_if(barcodes.begin(), barcodes.end(), [&seen](const std::string& bx) {
+	return !seen.insert(bx).second;
+      }), barcodes.end());
+  
+  // a BAM grouped by barcode has an offset table instead
+  BXIndex index;
+  BXOffsets offsets;
+  bool grouped = false;
+  if (!index.Open(opt::index)) {
+    grouped = offsets.Open(opt::index) || offsets.Open(opt::bam + ".bxo");
+    if (!grouped) {
+      std::cerr << "Could not read index " << opt::index << " (make it with bxtools index)" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  bam_hdr_t* hdr;
+  htsFile* fp = openBAM(opt::bam, hdr);
+  // the reads come out grouped by barcode, not in the order of the input
+  const SeqLib::BamHeader out_hdr(bxtools::UnsortedHeader(hdr->text ? std::string(hdr->text, strnlen(hdr->text, hdr->l_text)) : std::string()));
+  htsFile* out = sam_open("-", "wb");
+  if (!out || sam_hdr_write(out, out_hdr.get_()) < 0) {
+    std::cerr << "Failed to open output stream" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (bxtools::threads > 1)
+    hts_set_threads(out, bxtools::threads);
+  
+  bam1_t* b = bam_init1();
+  std::vector<int64_t> voffs;
+  char buf[32];
+  size_t count = 0;
+  for (const auto& bx : barcodes) {
+    if (grouped) {
+      count += fetchRange(offsets, bx, fp, hdr, b, out);
+      continue;
+    }
+    if (!index.Lookup(bx, voffs)) {
+      if (opt::verbose)
+	std::cerr << "...no reads for " << bx << std::endl;
+      continue;
+    }
+    // each offset is the first read of bx in a block. Read to the block end
+    for (const auto& v : voffs) {
+      if (bgzf_seek(fp->fp.bgzf, v, SEEK_SET) < 0) {
+	std::cerr << "Failed to seek in " << opt::bam << " (is the index from another file?)" << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      while ((bgzf_tell(fp->fp.bgzf) >> 16) == (v >> 16) && sam_read1(fp, hdr, b) >= 0) {
+	const char* t = BXTagValue(b, opt::tag.c_str(), buf, sizeof(buf));
+	if (!t || bx != t)
+	  continue;
+	writeRead(out, hdr, b);
+	++count;
+      }
+    }
+  }
+
+  bam_destroy1(b);
+  sam_close(out);
+  bam_hdr_destroy(hdr);
+  sam_close(fp);
+  if (opt::verbose)
+    std::cerr << "...fetched " << SeqLib::AddCommas(count) << " reads" << std::endl;
+}
+
+BXIndex::~BXIndex() {
+  if (m_base)
+    munmap((void*)m_base, m_size);
+}
+
+bool BXIndex::Open(const std::string& fn) {
+
+  int fd = open(fn.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BXIndexHeader)) {
+    close(fd);
+    return false;
+  }
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+  m_base = (const char*)p;
+  m_size = st.st_size;
+
+  memcpy(&m_hdr, m_base, sizeof(m_hdr));
+  // the entries must fit before the names, and the names before the data, so
+  // a truncated or foreign file is not read past the map
+  if (memcmp(m_hdr.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) ||
+      m_hdr.n_packed > m_size / sizeof(BXIndexEntry) || m_hdr.n_named > m_size / sizeof(BXIndexEntry) ||
+      m_hdr.off_names < sizeof(BXIndexHeader) + (m_hdr.n_packed + m_hdr.n_named) * sizeof(BXIndexEntry) ||
+      m_hdr.off_data < m_hdr.off_names || m_hdr.off_data > m_size)
+    return false;
+  m_packed = (const BXIndexEntry*)(m_base + sizeof(BXIndexHeader));
+  m_named = m_packed + m_hdr.n_packed;
+  return true;
+}
+
+bool BXIndex::Lookup(const std::string& bx, std::vector<int64_t>& voffs) const {
+
+  voffs.clear();
+  
+  // a throwaway dictionary tells whether the barcode packs
+  BXDict dict;
+  const BXID id = dict.Encode(bx);
+  const BXIndexEntry* e = nullptr;
+  if (BXDict::IsPacked(id)) {
+    const BXIndexEntry* end = m_packed + m_hdr.n_packed;
+    e = std::lower_bound(m_packed, end, id, [](const BXIndexEntry& a, BXID k) { return a.key < k; });
+    if (e == end || e->key != id)
+      return false;
+  } else {
+    const char* names = m_base + m_hdr.off_names;
+    const BXIndexEntry* end = m_named + m_hdr.n_named;
+    e = std::lower_bound(m_named, end, bx.c_str(), [names](const BXIndexEntry& a, const char* k) {
+	return strcmp(names + a.key, k) < 0; 
+      });
+    if (e == end || bx != names + e->key)
+      return false;
+  }
+
+  const unsigned char* p = (const unsigned char*)m_base + m_hdr.off_data + e->off;
+  int64_t block = 0;
+  for (uint64_t i = 0; i < e->n; ++i) {
+    block += BXGetVarint(p);
+    voffs.push_back(block << 16 | (int64_t)BXGetVarint(p));
+  }
+  return true;
+}
+
+static std::vector<std::string> parseOptions(int argc, char** argv, const char* usage) {
+
+  bool die = false;
+  bool help = false;
+
+  if (argc < 2) 
+    die = true;
+  else
+    opt::bam = std::string(argv[1]);
+
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v': opt::verbose = true; break;
+    case 'h': help = true; break;
+    case 't': arg >> opt::tag; break;
+    case 'o': arg >> opt::index; break;
+    case 'i': arg >> opt::index; break;
+    case 'f': arg >> opt::list; break;
+    }
+  }
+
+  if (die || help) {
+    std::cerr << "\n" << usage;
+    die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
+  }
+
+  if (opt::index.empty())
+    opt::index = opt::bam + ".bxi";
+
+  // what is left after the BAM are barcodes to fetch
+  std::vector<std::string> rest;
+  for (int i = optind + 1; i < argc; ++i)
+    rest.push_back(argv[i]);
+  return rest;
+}
+
+BXOffsets::~BXOffsets() {
+  if (m_base)
+    munmap((void*)m_base, m_size);
+}
+
+bool BXOffsets::Open(const std::string& fn) {
+
+  int fd = open(fn.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BXOffsetHeader)) {
+    close(fd);
+    return false;
+  }
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+  m_base = (const char*)p;
+  m_size = st.st_size;
+
+  memcpy(&m_hdr, m_base, sizeof(m_hdr));
+  if (memcmp(m_hdr.magic, OFFSET_MAGIC, sizeof(OFFSET_MAGIC)) || m_hdr.n > m_size / sizeof(BXOffsetEntry) ||
+      m_hdr.off_names < sizeof(BXOffsetHeader) + m_hdr.n * sizeof(BXOffsetEntry) || m_hdr.off_names > m_size)
+    return false;
+  m_entries = (const BXOffsetEntry*)(m_base + sizeof(BXOffsetHeader));
+  return true;
+}
+
+bool BXOffsets::Lookup(const std::string& bx, BXOffsetEntry& e) const {
+  const char* names = m_base + m_hdr.off_names;
+  const BXOffsetEntry* end = m_entries + m_hdr.n;
+  const BXOffsetEntry* f = std::lower_bound(m_entries, end, bx.c_str(), [names](const BXOffsetEntry& a, const char* k) {
+      return strcmp(names + a.name, k) < 0; 
+    });
+  if (f == end || bx != names + f->name)
+    return false;
+  e = *f;
+  return true;
+}
+
+bool BXOffsets::Write(const std::string& fn, const std::vector<BXOffsetEntry>& entries,
+		      const std::string& names) {
+  BXOffsetHeader h;
+  memcpy(h.magic, OFFSET_MAGIC, sizeof(OFFSET_MAGIC));
+  h.n = entries.size();
+  h.off_names = sizeof(h) + h.n * sizeof(BXOffsetEntry);
+  FILE* out = fopen(fn.c_str(), "wb");
+  if (!out)
+    return false;
+  bool ok = fwrite(&h, sizeof(h), 1, out) == 1 && 
+    fwrite(entries.data(), sizeof(BXOffsetEntry), entries.size(), out) == entries.size() &&
+    fwrite(names.data(), 1, names.size(), out) == names.size();
+  return fclose(out) == 0 && ok;
+}
@@ -0,0 +1,120 @@
+#ifndef BXTOOLS_BXINDEX_H__
+#define BXTOOLS_BXINDEX_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+void runIndex(int argc, char** argv);
+
+void runFetch(int argc, char** argv);
+
+// Sidecar index (.bxi) from barcode to the BGZF blocks holding its reads.
+// For each barcode there is one entry per block that has a read with that
+// barcode: the virtual offset of the first such read. A lookup seeks to each
+// and reads on to the end of the block. Layout:
+//
+//   BXIndexHeader
+//   packed       n_packed BXIndexEntry, sorted by key, for barcodes that
+//                pack into a BXID (key is the ID)
+//   named        n_named BXIndexEntry, sorted by name, for the rest (key is
+//                the offset of the name in names)
+//   names        NUL terminated barcode strings
+//   data         per barcode, n (block delta, offset in block) varint pairs.
+//                Block deltas are from the previous entry's block
+//
+// Everything is little endian, and the directories are read in place from a
+// memory map
+struct BXIndexHeader {
+  char magic[8];
+  uint64_t n_packed;
+  uint64_t n_named;
+  uint64_t off_names;
+  uint64_t off_data;
+};
+
+struct BXIndexEntry {
+  uint64_t key;
+  uint64_t off; // offset of the list in data
+  uint64_t n;   // number of virtual offsets
+};
+
+class BXIndex {
+
+ public:
+
+  BXIndex() {}
+
+  ~BXIndex();
+
+  bool Open(const std::string& fn);
+
+  // virtual offsets of the first read of bx in each block that has one,
+  // in file order. Returns false if the barcode is not in the index
+  bool Lookup(const std::string& bx, std::vector<int64_t>& voffs) const;
+
+ private:
+
+  BXIndex(const BXIndex&);
+  BXIndex& operator=(const BXIndex&);
+
+  const char* m_base = nullptr;
+  size_t m_size = 0;
+  BXIndexHeader m_hdr;
+  const BXIndexEntry* m_packed = nullptr;
+  const BXIndexEntry* m_named = nullptr;
+  
+};
+
+// Offset table (.bxo) of a BAM written grouped by barcode (split -o): the
+// reads of a barcode are the records from virtual offset begin up to end.
+// Layout:
+//
+//   BXOffsetHeader
+//   entries      n BXOffsetEntry, sorted by name
+//   names        NUL terminated barcode strings
+//
+// Little endian, and read in place from a memory map
+struct BXOffsetHeader {
+  char magic[8];
+  uint64_t n;
+  uint64_t off_names;
+};
+
+struct BXOffsetEntry {
+  uint64_t name;  // offset of the barcode in names
+  int64_t begin;  // virtual offset of the first read
+  int64_t end;    // virtual offset just past the last read
+  uint64_t n;     // number of reads
+};
+
+class BXOffsets {
+
+ public:
+
+  BXOffsets() {}
+
+  ~BXOffsets();
+
+  bool Open(const std::string& fn);
+
+  // returns false if the barcode is not in the table
+  bool Lookup(const std::string& bx, BXOffsetEntry& e) const;
+
+  // write a table. Entries must be sorted by name
+  static bool Write(const std::string& fn, const std::vector<BXOffsetEntry>& entries,
+		    const std::string& names);
+
+ private:
+
+  BXOffsets(const BXOffsets&);
+  BXOffsets& operator=(const BXOffsets&);
+
+  const char* m_base = nullptr;
+  size_t m_size = 0;
+  BXOffsetHeader m_hdr;
+  const BXOffsetEntry* m_entries = nullptr;
+  
+};
+
+#endif
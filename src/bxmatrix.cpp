@@ -0,0 +1,258 @@
+#include "bxmatrix.h"
+#include "bxvarint.h"
+#include "bxdictfile.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char MATRIX_MAGIC[8] = { 'B', 'X', 'M', 'T', 'X', 1, 0, 0 };
+
+BXMatrixWriter::~BXMatrixWriter() {
+  if (m_fp)
+    fclose(m_fp);
+  if (m_bgzf)
+    bgzf_close(m_bgzf);
+}
+
+bool BXMatrixWriter::Open(const std::string& fn, bool bgzf) {
+  if (bgzf)
+    m_bgzf = bgzf_open(fn.c_str(), "w");
+  else
+    m_fp = fopen(fn.c_str(), "wb");
+  if (!m_fp && !m_bgzf)
+    return false;
+  write(MATRIX_MAGIC, sizeof(MATRIX_MAGIC));
+  m_rowptr.push_back(0);
+  return true;
+}
+
+void BXMatrixWriter::write(const void* p, size_t n) {
+  bool ok = m_fp ? fwrite(p, 1, n, m_fp) == n : bgzf_write(m_bgzf, p, n) == (ssize_t)n;
+  if (!ok) {
+    std::cerr << "Failed writing tile matrix" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  m_off += n;
+}
+
+void BXMatrixWriter::AddTile(int32_t chr, int32_t pos1, int32_t pos2, 
+			     const std::unordered_map<BXID, size_t, BXHash>& counts) {
+
+  BXMatrixTile t;
+  t.chr = chr;
+  t.pos1 = pos1;
+  t.pos2 = pos2;
+  m_tiles.push_back(t);
+
+  const uint32_t base = m_file ? m_file->size() : 0;
+  m_row.clear();
+  for (const auto& c : counts) {
+    if (m_file && BXDict::IsDict(c.first)) {
+      m_row.push_back(std::make_pair((uint32_t)(c.first & ~BXDict::DICT), (uint32_t)c.second));
+      continue;
+    }
+    auto ff = m_cols.find(c.first);
+    uint32_t col;
+    if (ff == m_cols.end()) {
+      col = base + m_ids.size();
+      m_cols.insert(std::make_pair(c.first, col));
+      m_ids.push_back(c.first);
+    } else {
+      col = ff->second;
+    }
+    m_row.push_back(std::make_pair(col, (uint32_t)c.second));
+  }
+  std::sort(m_row.begin(), m_row.end());
+
+  m_buf.clear();
+  uint32_t last = 0;
+  for (const auto& c : m_row) {
+    BXPutVarint(m_buf, c.first - last);
+    BXPutVarint(m_buf, c.second);
+    last = c.first;
+  }
+  write(m_buf.data(), m_buf.size());
+  m_nnz += m_row.size();
+  m_rowptr.push_back(m_off - sizeof(MATRIX_MAGIC));
+}
+
+bool BXMatrixWriter::Close(const BXDict& dict) {
+
+  BXMatrixFooter f;
+  f.n_tiles = m_tiles.size();
+  const uint64_t base = m_file ? m_file->size() : 0;
+  f.n_barcodes = base + m_ids.size();
+  f.nnz = m_nnz;
+
+  f.off_rowptr = m_off;
+  write(m_rowptr.data(), m_rowptr.size() * sizeof(uint64_t));
+
+  f.off_tiles = m_off;
+  write(m_tiles.data(), m_tiles.size() * sizeof(BXMatrixTile));
+
+  f.off_chroms = m_off;
+  const uint32_t nchr = m_chroms.size();
+  write(&nchr, sizeof(nchr));
+  for (const auto& c : m_chroms)
+    write(c.c_str(), c.size() + 1);
+
+  // barcode offsets, then the names
+  f.off_barcodes = m_off;
+  m_buf.clear();
+  std::vector<uint64_t> offs;
+  offs.reserve(f.n_barcodes + 1);
+  for (uint64_t i = 0; i < base; ++i) {
+    offs.push_back(m_buf.size());
+    m_buf.append(m_file->Name(i), m_file->NameLength(i) + 1);
+  }
+  for (const auto& id : m_ids) {
+    offs.push_back(m_buf.size());
+    dict.Decode(id, m_buf);
+    m_buf.push_back('\0');
+  }
+  offs.push_back(m_buf.size());
+  write(offs.data(), offs.size() * sizeof(uint64_t));
+  write(m_buf.data(), m_buf.size());
+
+  memcpy(f.magic, MATRIX_MAGIC, sizeof(MATRIX_MAGIC));
+  write(&f, sizeof(f));
+
+  bool ok = m_fp ? fclose(m_fp) == 0 : bgzf_close(m_bgzf) == 0;
+  m_fp = nullptr;
+  m_bgzf = nullptr;
+  return ok;
+}
+
+BXMatrix::~BXMatrix() {
+  if (m_mapped)
+    munmap((void*)m_base, m_size);
+}
+
+bool BXMatrix::Open(const std::string& fn) {
+
+  int fd = open(fn.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)(sizeof(MATRIX_MAGIC) + sizeof(BXMatrixFooter))) {
+    close(fd);
+    return false;
+  }
+
+  char magic[2];
+  if (pread(fd, magic, 2, 0) != 2) {
+    close(fd);
+    return false;
+  }
+
+  if ((unsigned char)magic[0] == 0x1f && (unsigned char)magic[1] == 0x8b) {
+    // compressed, inflate the whole thing
+    BGZF* fp = bgzf_dopen(fd, "r");
+    if (!fp) {
+      close(fd);
+      return false;
+    }
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = bgzf_read(fp, buf, sizeof(buf))) > 0)
+      m_inflated.insert(m_inflated.end(), buf, buf + n);
+    bgzf_close(fp);
+    if (n < 0)
+      return false;
+    m_base = m_inflated.data();
+    m_size = m_inflated.size();
+  } else {
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+      return false;
+    m_base = (const char*)p;
+    m_size = st.st_size;
+    m_mapped = true;
+  }
+
+  if (m_size < sizeof(MATRIX_MAGIC) + sizeof(BXMatrixFooter) || memcmp(m_base, MATRIX_MAGIC, sizeof(MATRIX_MAGIC)))
+    return false;
+  memcpy(&m_foot, m_base + m_size - sizeof(BXMatrixFooter), sizeof(BXMatrixFooter));
+  if (memcmp(m_foot.magic, MATRIX_MAGIC, sizeof(MATRIX_MAGIC)))
+    return false;
+
+  // the sections must be in order and fit before the footer, so a truncated
+  // or foreign file is not read past the end
+  const uint64_t foot = m_size - sizeof(BXMatrixFooter);
+  const uint64_t& n = m_foot.n_tiles;
+  const uint64_t& nb = m_foot.n_barcodes;
+  if (n >= m_size / sizeof(BXMatrixTile) || nb >= m_size / sizeof(uint64_t) ||
+      m_foot.off_rowptr < sizeof(MATRIX_MAGIC) ||
+      m_foot.off_tiles < m_foot.off_rowptr + (n + 1) * sizeof(uint64_t) ||
+      m_foot.off_chroms < m_foot.off_tiles + n * sizeof(BXMatrixTile) ||
+      m_foot.off_barcodes < m_foot.off_chroms + sizeof(uint32_t) ||
+      m_foot.off_barcodes + (nb + 1) * sizeof(uint64_t) > foot)
+    return false;
+
+  // and the offsets into data and names must ascend within their section
+  auto ascending = [this](uint64_t off, uint64_t count, uint64_t limit) {
+    uint64_t last = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+      const uint64_t v = u64(off + i * sizeof(uint64_t));
+      if (v < last || v > limit)
+	return false;
+      last = v;
+    }
+    return true;
+  };
+  const uint64_t names = m_foot.off_barcodes + (nb + 1) * sizeof(uint64_t);
+  if (!ascending(m_foot.off_rowptr, n + 1, m_foot.off_rowptr - sizeof(MATRIX_MAGIC)) ||
+      !ascending(m_foot.off_barcodes, nb + 1, foot - names) ||
+      (nb && m_base[names + u64(m_foot.off_barcodes + nb * sizeof(uint64_t)) - 1]))
+    return false;
+
+  uint32_t nchr;
+  memcpy(&nchr, m_base + m_foot.off_chroms, sizeof(nchr));
+  const char* c = m_base + m_foot.off_chroms + sizeof(nchr);
+  const char* cend = m_base + m_foot.off_barcodes;
+  for (uint32_t i = 0; i < nchr; ++i) {
+    const char* z = (const char*)memchr(c, '\0', cend - c);
+    if (!z)
+      return false;
+    m_chroms.push_back(c);
+    c = z + 1;
+  }
+  return true;
+}
+
+uint64_t BXMatrix::u64(uint64_t off) const {
+  uint64_t v;
+  memcpy(&v, m_base + off, sizeof(v));
+  return v;
+}
+
+BXMatrixTile BXMatrix::Tile(uint64_t i) const {
+  BXMatrixTile t;
+  memcpy(&t, m_base + m_foot.off_tiles + i * sizeof(BXMatrixTile), sizeof(t));
+  return t;
+}
+
+const char* BXMatrix::Barcode(uint64_t col) const {
+  const uint64_t names = m_foot.off_barcodes + (m_foot.n_barcodes + 1) * sizeof(uint64_t);
+  return m_base + names + u64(m_foot.off_barcodes + col * sizeof(uint64_t));
+}
+
+void BXMatrix::Row(uint64_t i, std::vector<std::pair<uint32_t, uint32_t> >& out) const {
+  out.clear();
+  const uint64_t beg = u64(m_foot.off_rowptr + i * sizeof(uint64_t));
+  const uint64_t end = u64(m_foot.off_rowptr + (i + 1) * sizeof(uint64_t));
+  const unsigned char* p = (const unsigned char*)m_base + sizeof(MATRIX_MAGIC) + beg;
+  const unsigned char* e = (const unsigned char*)m_base + sizeof(MATRIX_MAGIC) + end;
+  uint32_t col = 0;
+  while (p < e) {
+    col += BXGetVarint(p);
+    out.push_back(std::make_pair(col, (uint32_t)BXGetVarint(p)));
+  }
+}
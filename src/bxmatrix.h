@@ -0,0 +1,142 @@
+#ifndef BXTOOLS_BXMATRIX_H__
+#define BXTOOLS_BXMATRIX_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <utility>
+
+#include "htslib/bgzf.h"
+
+#include "bxdict.h"
+
+// Sparse tile x barcode count matrix, written by "bxtools tile -o". Rows are
+// tiles in genome order and columns are dense barcode indices, in the order
+// barcodes were first seen. With a barcode dictionary (--dict) the first
+// columns are instead every barcode of the dictionary, by ID, so matrices of
+// one library share columns, and barcodes not in it follow. The layout is CSR:
+//
+//   magic        8 bytes "BXMTX\1\0\0"
+//   data         per row, (column delta, count) pairs as LEB128 varints,
+//                columns ascending and delta-coded from the previous column
+//   rowptr       n_tiles + 1 uint64 byte offsets into data
+//   tiles        n_tiles x (int32 chr, int32 start, int32 end)
+//   chromosomes  uint32 count, then NUL terminated names
+//   barcodes     n_barcodes + 1 uint64 offsets into the names that follow,
+//                then NUL terminated barcode strings
+//   footer       BXMatrixFooter
+//
+// Everything is little endian. An uncompressed file can be memory mapped
+// and read in place; a BGZF compressed one is inflated into memory on open.
+// Section offsets are in the footer, so the file is written in one pass
+
+struct BXMatrixFooter {
+  uint64_t n_tiles;
+  uint64_t n_barcodes;
+  uint64_t nnz;
+  uint64_t off_rowptr;
+  uint64_t off_tiles;
+  uint64_t off_chroms;
+  uint64_t off_barcodes;
+  char magic[8];
+};
+
+struct BXMatrixTile {
+  int32_t chr;
+  int32_t pos1;
+  int32_t pos2;
+};
+
+class BXMatrixWriter {
+
+ public:
+
+  BXMatrixWriter() {}
+
+  ~BXMatrixWriter();
+
+  // open the output, optionally BGZF compressed
+  bool Open(const std::string& fn, bool bgzf);
+
+  void SetChromosomes(const std::vector<std::string>& names) { m_chroms = names; }
+
+  // give barcodes of the file (if not null) their column there. Call before
+  // adding tiles
+  void SetDictionary(const BXDictFile* file) { m_file = file; }
+
+  // add the next tile. Counts are keyed on barcode ID
+  void AddTile(int32_t chr, int32_t pos1, int32_t pos2, 
+	       const std::unordered_map<BXID, size_t, BXHash>& counts);
+
+  // write the trailing sections and close. Barcode names come from dict
+  bool Close(const BXDict& dict);
+
+ private:
+
+  BXMatrixWriter(const BXMatrixWriter&);
+  BXMatrixWriter& operator=(const BXMatrixWriter&);
+
+  FILE* m_fp = nullptr;
+  BGZF* m_bgzf = nullptr;
+  uint64_t m_off = 0; // bytes written so far
+  uint64_t m_nnz = 0;
+
+  std::vector<std::string> m_chroms;
+  std::vector<BXMatrixTile> m_tiles;
+  std::vector<uint64_t> m_rowptr;
+  const BXDictFile* m_file = nullptr;
+  std::unordered_map<BXID, uint32_t, BXHash> m_cols;
+  std::vector<BXID> m_ids; // barcode ID of each column after the dictionary's
+
+  std::vector<std::pair<uint32_t, uint32_t> > m_row; // scratch
+  std::string m_buf; // scratch
+  
+  void write(const void* p, size_t n);
+  
+};
+
+// Read access to a matrix file
+class BXMatrix {
+
+ public:
+
+  BXMatrix() {}
+
+  ~BXMatrix();
+
+  bool Open(const std::string& fn);
+
+  uint64_t NumTiles() const { return m_foot.n_tiles; }
+
+  uint64_t NumBarcodes() const { return m_foot.n_barcodes; }
+
+  uint64_t NumNonZero() const { return m_foot.nnz; }
+
+  BXMatrixTile Tile(uint64_t i) const;
+
+  const char* ChrName(int chr) const { return m_chroms[chr]; }
+
+  const char* Barcode(uint64_t col) const;
+
+  // decode row i into (column, count) pairs
+  void Row(uint64_t i, std::vector<std::pair<uint32_t, uint32_t> >& out) const;
+
+ private:
+
+  BXMatrix(const BXMatrix&);
+  BXMatrix& operator=(const BXMatrix&);
+
+  const char* m_base = nullptr; // start of the file contents
+  size_t m_size = 0;
+  bool m_mapped = false;
+  std::vector<char> m_inflated; // contents of a compressed file
+  BXMatrixFooter m_foot;
+  std::vector<const char*> m_chroms;
+
+  uint64_t u64(uint64_t off) const;
+  
+};
+
+#endif
@@ -3,24 +3,37 @@
 #include <getopt.h>
 #include <iostream>
 #include <sstream>
+#include <queue>
+#include <set>
+#include <climits>
+#include <algorithm>
 
 #include "SeqLib/BamReader.h"
 #include "SeqLib/GenomicRegionCollection.h"
 
 #include "bxcommon.h"
+#include "bxprof.h"
+#include "bxaux.h"
+#include "bxdict.h"
 
 namespace opt {
 
   static std::string bam; // the bam to analyze
   static bool verbose = false; 
   static std::string tag = "BX";
+  static bool stream = false; // sorted input, write molecules as they close
+  static int gap = 50000; // close a molecule this far past its last read
+  static int max_len = 1000000; // close a molecule this far past its first read
 }
 
-static const char* shortopts = "hvt:";
+static const char* shortopts = "hvst:g:L:";
 static const struct option longopts[] = {
   { "help",                    no_argument, NULL, 'h' },
   { "verbose",                 no_argument, NULL, 'v' },
   { "tag",                     required_argument, NULL, 't' },
+  { "stream",                  no_argument, NULL, 's' },
+  { "gap",                     required_argument, NULL, 'g' },
+  { "max-len",                 required_argument, NULL, 'L' },
   { NULL, 0, NULL, 0 }
 };
 
@@ -31,70 +44,349 @@ static const char *MOL_USAGE_MESSAGE =
 "  General options\n"
 "  -v, --verbose         Set verbose output\n"
 "  -t, --tag             Use a different tag other than MI\n"
+"  -s, --stream          Input is coordinate sorted: write molecules (sorted) as soon as they close\n"
+"  -g, --gap             With -s, close a molecule once the input is this far past its last read [50,000]\n"
+"  -L, --max-len         With -s, close a molecule once the input is this far past its first read [1,000,000]\n"
 "\n";
 
-class BXMol {
-  
-public:
-  
-  BXMol() {}
+// A molecule: where its reads fall, how many there are, and its barcodes.
+// Plain data, so millions of them can sit in one vector. A molecule almost
+// always has a single barcode, so only the first INLINE are kept here, and
+// any more by the owner of the molecule, keyed by its ID
+struct BXMol {
 
-  int min = INT_MAX;
-  int max = -1;
-  int chr = -1;
+  static const uint32_t INLINE = 1;
 
-  std::unordered_set<std::string> bx; // BX tag
-  //std::string bx; // BX tag
-  std::string mi; // MI (or -t) tag
-  std::string tmpbx; // tmp to be overwritted to hold new bx
-  
-  int nr = 0; // num reads
-  std::string chr_string;
+  BXID mi; // MI (or -t) tag
+  BXID bx[INLINE]; // BX tags
+  int32_t chr;
+  int32_t min;
+  int32_t max;
+  uint32_t nr; // num reads
+  uint32_t nbx; // num BX tags
+
+  void init(BXID m) {
+    mi = m;
+    chr = -1;
+    min = INT_MAX;
+    max = -1;
+    nr = 0;
+    nbx = 0;
+  }
+};
+
+const uint32_t BXMol::INLINE;
+
+// barcodes of a molecule past the first BXMol::INLINE
+typedef std::unordered_map<BXID, std::vector<BXID>, BXHash> BXMolMore;
+
+static const size_t BXMOL_FLUSH = 1 << 20; // bytes of BED to buffer before writing
+
+// add a read of barcode bx to m. Returns false if the read is on another
+// chromosome than the molecule
+static bool addRead(BXMol& m, BXMolMore& more, const SeqLib::BamRecord& r, BXID bx) {
+
+  if (m.chr >= 0 && m.chr != r.ChrID())
+    return false;
+
+  ++m.nr;
+  m.chr = r.ChrID();
+  m.min = std::min(r.Position(), m.min);
+  m.max = std::max(r.PositionEnd(), m.max);
+
+  const uint32_t n = std::min(m.nbx, BXMol::INLINE);
+  if (std::find(m.bx, m.bx + n, bx) != m.bx + n)
+    return true;
+  if (m.nbx < BXMol::INLINE) {
+    m.bx[m.nbx++] = bx;
+    return true;
+  }
+  std::vector<BXID>& v = more[m.mi];
+  if (std::find(v.begin(), v.end(), bx) == v.end()) {
+    v.push_back(bx);
+    ++m.nbx;
+  }
+  return true;
+}
+
+// append the BED line of a molecule to out: chr, start, end, molecule ID,
+// comma separated barcodes and read count
+static void formatMol(std::string& out, const BXMol& m, const std::vector<BXID>* more, 
+		      const BXDict& d, const SeqLib::BamHeader& h) {
+  out += h.IDtoName(m.chr);
+  out.push_back('\t');
+  out += std::to_string(m.min);
+  out.push_back('\t');
+  out += std::to_string(m.max);
+  out.push_back('\t');
+  d.Decode(m.mi, out);
+  out.push_back('\t');
+  for (uint32_t i = 0; i < std::min(m.nbx, BXMol::INLINE); ++i) {
+    if (i)
+      out.push_back(',');
+    d.Decode(m.bx[i], out);
+  }
+  if (more)
+    for (const auto& b : *more) {
+      out.push_back(',');
+      d.Decode(b, out);
+    }
+  out.push_back('\t');
+  out += std::to_string(m.nr);
+  out.push_back('\n');
+}
+
+// Every molecule of a run, in one vector in the order they were first seen.
+// Numeric molecule IDs (MI:i counts up from 0) index a dense vector of
+// positions in it, anything else goes through a hash
+class BXMolTable {
+
+ public:
+
+  // the molecule with ID mi, made empty if it is new
+  BXMol& Get(BXID mi) {
+    uint32_t& slot = slotFor(mi);
+    if (!slot) {
+      m_mols.push_back(BXMol());
+      m_mols.back().init(mi);
+      slot = m_mols.size();
+    }
+    return m_mols[slot - 1];
+  }
+
+  bool Add(BXID mi, const SeqLib::BamRecord& r, BXID bx) {
+    return addRead(Get(mi), m_more, r, bx);
+  }
+
+  // write every molecule as BED
+  void Write(std::ostream& os, const BXDict& d, const SeqLib::BamHeader& h) const {
+    std::string out;
+    out.reserve(BXMOL_FLUSH + 4096);
+    for (const auto& m : m_mols) {
+      const std::vector<BXID>* more = nullptr;
+      if (m.nbx > BXMol::INLINE)
+	more = &m_more.find(m.mi)->second;
+      formatMol(out, m, more, d, h);
+      if (out.size() >= BXMOL_FLUSH) {
+	os.write(out.data(), out.size());
+	out.clear();
+      }
+    }
+    os.write(out.data(), out.size());
+  }
+
+  const std::unordered_map<BXID, uint32_t, BXHash>& Index() const { return m_index; }
+
+ private:
+
+  std::vector<BXMol> m_mols;
+  std::vector<uint32_t> m_dense; // 1 + position in m_mols, by numeric ID
+  std::unordered_map<BXID, uint32_t, BXHash> m_index; // the same, by any other ID
+  BXMolMore m_more;
+
+  uint32_t& slotFor(BXID mi) {
+    if ((mi & (BXDict::INTERNED | BXDict::NUMERIC)) == BXDict::NUMERIC) {
+      const uint64_t v = mi & ~BXDict::NUMERIC;
+      if (v < m_dense.size())
+	return m_dense[v];
+      // grow while IDs stay dense, moving over any that were hashed for being too big
+      if (v < 2 * m_mols.size() + (1 << 20)) {
+	m_dense.resize(std::max(std::max((size_t)v + 1, m_dense.size() * 3 / 2), (size_t)1024));
+	for (auto it = m_index.begin(); it != m_index.end();) {
+	  const uint64_t w = it->first & ~BXDict::NUMERIC;
+	  if ((it->first & (BXDict::INTERNED | BXDict::NUMERIC)) == BXDict::NUMERIC && w < m_dense.size()) {
+	    m_dense[w] = it->second;
+	    it = m_index.erase(it);
+	  } else {
+	    ++it;
+	  }
+	}
+	return m_dense[v];
+      }
+    }
+    return m_index[mi];
+  }
+
+};
+
+// Molecules from coordinate sorted input. Only open molecules are kept: a
+// molecule is closed once the input is opt::gap past its last read or
+// opt::max_len past its first, and a read with the same tag after that
+// starts a new one. Closed molecules wait until no open molecule starts
+// before them, so the output is in BED order
+class BXMolStream {
+
+public:
+
+  BXMolStream(const BXDict& d, const SeqLib::BamHeader& h, std::ostream& os) : m_dict(d), m_hdr(h), m_os(os) {}
 
-  bool add(const SeqLib::BamRecord& r, const SeqLib::BamHeader h) {
+  // add a read. Returns false if reads are out of order
+  bool Add(const SeqLib::BamRecord& r, BXID mi, BXID bx) {
     
-    if (chr > 0 && chr != r.ChrID()) {
-      std::cerr << "Warning: " << opt::tag << " "  << mi << " spans multiple chromosomes" << std::endl;
+    const int chr = r.ChrID();
+    const int pos = r.Position();
+    if (chr < m_chr || (chr == m_chr && pos < m_last))
       return false;
+    if (chr != m_chr) {
+      closeAll();
+      m_chr = chr;
     }
+    m_last = pos;
 
-    
-    r.GetTag(opt::tag, mi);
+    // close everything the input has moved past
+    while (!m_deadlines.empty() && m_deadlines.top().first < pos) {
+      const BXID id = m_deadlines.top().second;
+      const int when = m_deadlines.top().first;
+      m_deadlines.pop();
+      auto ff = m_open.find(id);
+      if (ff != m_open.end() && deadline(ff->second) == when) // else stale
+	close(ff);
+    }
 
-    ++nr;
-    
-    // get the BX tag
-    r.GetTag("BX", tmpbx);
-    bx.insert(tmpbx);
-
-    // set the position
-    chr = r.ChrID();
-    min = std::min(r.Position(), min);
-    max = std::max(r.PositionEnd(), max);
-    if (chr_string.empty())
-      chr_string = h.IDtoName(chr);
-    
+    auto ins = m_open.insert(std::make_pair(mi, BXMol()));
+    BXMol& m = ins.first->second;
+    if (ins.second) {
+      m.init(mi);
+      m_starts.insert(pos);
+    }
+    addRead(m, m_more, r, bx);
+    m_deadlines.push(std::make_pair(deadline(m), mi));
+
+    release();
     return true;
+  }
+
+  // close and write everything left
+  void Finish() {
+    closeAll();
+    m_os.write(m_out.data(), m_out.size());
+    m_out.clear();
+  }
+  
+private:
 
+  typedef std::pair<int, BXID> BXDeadline;
+
+  struct BXClosed {
+    BXMol m;
+    std::vector<BXID> more; // barcodes past the inline ones
+    bool operator>(const BXClosed& c) const {
+      return m.min > c.m.min || (m.min == c.m.min && m.max > c.m.max);
+    }
+  };
+  
+  const BXDict& m_dict;
+  const SeqLib::BamHeader& m_hdr;
+  std::ostream& m_os;
+  std::string m_out; // BED not yet written
+  int m_chr = -1;
+  int m_last = -1;
+  std::unordered_map<BXID, BXMol, BXHash> m_open;
+  BXMolMore m_more; // of the open molecules
+  std::multiset<int> m_starts; // starts of the open molecules
+  std::priority_queue<BXDeadline, std::vector<BXDeadline>, std::greater<BXDeadline> > m_deadlines;
+  std::priority_queue<BXClosed, std::vector<BXClosed>, std::greater<BXClosed> > m_closed;
+
+  // position past which a molecule is closed
+  static int deadline(const BXMol& m) {
+    return std::min((int64_t)m.max + opt::gap, (int64_t)m.min + opt::max_len);
   }
   
-  friend std::ostream& operator<<(std::ostream& out, const BXMol& b) {
-    std::stringstream ss;
-    for (auto& i : b.bx)
-      ss << i << ",";
-    std::string bxstring = ss.str();
-    if (!bxstring.empty())
-      bxstring.pop_back(); // remove last comma
-    out << b.chr_string << "\t" << b.min << "\t" 
-	<< b.max << "\t" << b.mi << "\t" << bxstring << "\t" 
-	<< b.nr;
-    return out;
+  void close(std::unordered_map<BXID, BXMol, BXHash>::iterator it) {
+    m_starts.erase(m_starts.find(it->second.min));
+    BXClosed c;
+    c.m = it->second;
+    if (c.m.nbx > BXMol::INLINE) {
+      auto mm = m_more.find(c.m.mi);
+      c.more.swap(mm->second);
+      m_more.erase(mm);
+    }
+    m_closed.push(std::move(c));
+    m_open.erase(it);
   }
 
+  void closeAll() {
+    while (!m_open.empty())
+      close(m_open.begin());
+    m_deadlines = decltype(m_deadlines)();
+    release();
+  }
+
+  // write the closed molecules that nothing open can precede
+  void release() {
+    const int first = m_starts.empty() ? INT_MAX : *m_starts.begin();
+    while (!m_closed.empty() && m_closed.top().m.min <= first) {
+      formatMol(m_out, m_closed.top().m, &m_closed.top().more, m_dict, m_hdr);
+      m_closed.pop();
+    }
+    if (m_out.size() >= BXMOL_FLUSH) {
+      m_os.write(m_out.data(), m_out.size());
+      m_out.clear();
+    }
+  }
+  
 };
 
 static void parseOptions(int argc, char** argv);
 
+// molecule footprints from the reads, either all held until the end, or
+// streamed as they close (-s)
+class BXMolVisitor : public BXVisitor {
+
+public:
+
+  BXMolVisitor(const SeqLib::BamHeader& h, std::ostream& os) 
+    : m_hdr(h), m_os(os), m_dict(bxtools::GetDict()), m_stream(m_dict, h, os), m_aux(opt::tag.c_str(), "BX") {}
+
+  void Visit(const SeqLib::BamRecord& r) {
+    BXPhaseTimer tag_time(BXPHASE_TAG);
+    BXStrRef mi, bx;
+    if (!r.MappedFlag() || !m_aux.Scan(r.raw()) || !m_aux.Text(0, mi))
+      return;
+    m_aux.Text(1, bx);
+    tag_time.Stop();
+
+    BXPhaseTimer map_time(BXPHASE_MAP);
+    const BXID id = m_dict.Encode(mi.data, mi.size);
+    ++m_found;
+    if (opt::stream) {
+      if (!m_stream.Add(r, id, m_dict.Encode(bx.data, bx.size))) {
+	std::cerr << "Input is not coordinate sorted at read " << r.Brief() << std::endl;
+	exit(EXIT_FAILURE);
+      }
+    } else if (!m_mols.Add(id, r, m_dict.Encode(bx.data, bx.size))) {
+      std::cerr << "Warning: " << opt::tag << " "  << mi << " spans multiple chromosomes" << std::endl;
+    }
+  }
+
+  void Finish() {
+    bxtools::Profile().Map("mol.index", m_mols.Index());
+    if (opt::stream)
+      m_stream.Finish();
+    else
+      m_mols.Write(m_os, m_dict, m_hdr);
+    m_os.flush();
+  }
+
+  size_t Found() const { return m_found; }
+  
+private:
+
+  const SeqLib::BamHeader& m_hdr;
+  std::ostream& m_os;
+  BXDict m_dict;
+  BXMolStream m_stream;
+  BXMolTable m_mols;
+  size_t m_found = 0; // reads with the tag
+  BXAux m_aux;
+  
+};
+
+BXVisitor* NewMolVisitor(int argc, char** argv, const SeqLib::BamHeader& hdr, std::ostream& os) {
+  parseOptions(argc, argv);
+  return new BXMolVisitor(hdr, os);
+}
+
 void runMol(int argc, char** argv) {
   
   parseOptions(argc, argv);
@@ -103,20 +395,15 @@ void runMol(int argc, char** argv) {
   BXOPEN(reader, opt::bam);
   SeqLib::BamHeader hdr = reader.Header();
 
-  std::unordered_map<std::string, BXMol> molmap;
-
+  BXMolVisitor mols(hdr, std::cout);
+  
   SeqLib::BamRecord r;
   size_t count = 0; 
-  std::string mi;
-  //int32_t mi;
-  while (reader.GetNextRecord(r)) {
-    BXLOOPCHECK(r, molmap.size(), opt::tag);
-    if (r.MappedFlag() && r.GetTag(opt::tag, mi)) 
-      molmap[mi].add(r, hdr);
-  }  
-  // print them out as a BED
-  for (const auto& b : molmap)
-    std::cout << b.second << std::endl;
+  while (BXNextRecord(reader, r)) {
+    BXLOOPCHECK(r, mols.Found(), opt::tag);
+    mols.Visit(r);
+  }
+  mols.Finish();
 }
 
 static void parseOptions(int argc, char** argv) {
@@ -137,6 +424,9 @@ static void parseOptions(int argc, char** argv) {
     case 'v': opt::verbose = true; break;
     case 'h': help = true; break;
     case 't': arg >> opt::tag; break;
+    case 's': opt::stream = true; break;
+    case 'g': arg >> opt::gap; break;
+    case 'L': arg >> opt::max_len; break;
     }
   }
 
@@ -1,6 +1,16 @@
 #ifndef BXTOOLS_MOL_H
 #define BXTOOLS_MOL_H
 
+#include <ostream>
+
+#include "SeqLib/BamHeader.h"
+
+#include "bxvisitor.h"
+
 void runMol(int argc, char** argv);
 
+// parse mol options from argv (argv[1] is the BAM) and return the per-read
+// accumulator, writing molecules to os
+BXVisitor* NewMolVisitor(int argc, char** argv, const SeqLib::BamHeader& hdr, std::ostream& os);
+
 #endif
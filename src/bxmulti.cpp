@@ -0,0 +1,236 @@
+#include "bxmulti.h"
+
+#include <getopt.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <memory>
+
+#include "SeqLib/BamReader.h"
+
+#include "bxcommon.h"
+#include "bxprof.h"
+#include "bxstats.h"
+#include "bxtile.h"
+#include "bxmol.h"
+
+namespace opt {
+
+  static std::string bam; // the bam to analyze
+  static bool verbose = false; 
+  static std::string stats; // output files
+  static std::string tile;
+  static std::string mol;
+  static std::string stats_args; // options for each analysis
+  static std::string tile_args;
+  static std::string mol_args;
+}
+
+static const char* shortopts = "hvS:T:M:";
+static const struct option longopts[] = {
+  { "help",                    no_argument, NULL, 'h' },
+  { "verbose",                 no_argument, NULL, 'v' },
+  { "stats",                   required_argument, NULL, 'S' },
+  { "tile",                    required_argument, NULL, 'T' },
+  { "mol",                     required_argument, NULL, 'M' },
+  { "stats-args",              required_argument, NULL, 's' },
+  { "tile-args",               required_argument, NULL, 't' },
+  { "mol-args",                required_argument, NULL, 'm' },
+  { NULL, 0, NULL, 0 }
+};
+
+static const char *MULTI_USAGE_MESSAGE =
+"Usage: bxtools multi <BAM/SAM/CRAM> -S stats.tsv -T tiles.bed -M mol.bed\n"
+"Description: Run stats, tile and mol in one pass over the BAM\n"
+"\n"
+"  General options\n"
+"  -v, --verbose         Set verbose output\n"
+"  -S, --stats           Run stats, writing to this file\n"
+"  -T, --tile            Run tile, writing to this file\n"
+"  -M, --mol             Run mol, writing to this file\n"
+"      --stats-args      Options for stats, quoted (e.g. \"-s -p\")\n"
+"      --tile-args       Options for tile, quoted (e.g. \"-w 2000\")\n"
+"      --mol-args        Options for mol, quoted (e.g. \"-s -g 60000\")\n"
+"\n";
+
+static void parseOptions(int argc, char** argv);
+
+// a command line for one of the analyses: name, BAM, then its own options
+class BXSubArgs {
+
+public:
+
+  BXSubArgs(const std::string& name, const std::string& args) {
+    m_args.push_back(name);
+    m_args.push_back(opt::bam);
+    std::istringstream iss(args);
+    std::string a;
+    while (iss >> a)
+      m_args.push_back(a);
+    for (auto& s : m_args)
+      m_argv.push_back(&s[0]);
+    m_argv.push_back(nullptr);
+    optind = 0; // reset getopt for the analysis' own parser
+  }
+
+  int argc() const { return m_args.size(); }
+  
+  char** argv() { return m_argv.data(); }
+
+private:
+
+  std::vector<std::string> m_args;
+  std::vector<char*> m_argv;
+  
+};
+
+// Feed every read to each visitor. The reader fills batches of reads, and
+// each visitor works through the batches in order on its own thread. A batch
+// is refilled once every visitor is done with it. So the BAM is decoded once,
+// and the analyses run side by side rather than one after another
+static void visitAll(SeqLib::BamReader& reader, const std::vector<BXVisitor*>& visitors) {
+
+  const size_t BATCH = 4096;
+  const size_t NBATCH = 8;
+  std::vector<SeqLib::BamRecordVector> batches(NBATCH, SeqLib::BamRecordVector(BATCH));
+  std::vector<size_t> sizes(NBATCH, 0);
+  std::vector<size_t> done(visitors.size(), 0); // batches finished, per visitor
+  size_t filled = 0; // batches read
+  bool eof = false;
+  std::mutex mtx;
+  std::condition_variable cv;
+
+  auto worker = [&](size_t v) {
+    for (size_t k = 0;; ++k) {
+      {
+	std::unique_lock<std::mutex> lock(mtx);
+	cv.wait(lock, [&]() { return filled > k || eof; });
+	if (filled <= k)
+	  break;
+      }
+      const size_t slot = k % NBATCH;
+      for (size_t i = 0; i < sizes[slot]; ++i)
+	visitors[v]->Visit(batches[slot][i]);
+      std::lock_guard<std::mutex> lock(mtx);
+      done[v] = k + 1;
+      cv.notify_all();
+    }
+    visitors[v]->Finish();
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < visitors.size(); ++i)
+    threads.push_back(std::thread(worker, i));
+
+  size_t count = 0;
+  for (size_t k = 0; !eof; ++k) {
+    const size_t slot = k % NBATCH;
+    if (k >= NBATCH) {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [&]() { return *std::min_element(done.begin(), done.end()) > k - NBATCH; });
+    }
+    
+    SeqLib::BamRecordVector& b = batches[slot];
+    size_t n = 0;
+    while (n < BATCH && BXNextRecord(reader, b[n]))
+      ++n;
+    count += n;
+    if (opt::verbose && n && count / 1000000 != (count - n) / 1000000)
+      std::cerr << "...at read " << SeqLib::AddCommas(count) << " at pos " << b[n - 1].Brief() << std::endl;
+
+    std::lock_guard<std::mutex> lock(mtx);
+    sizes[slot] = n;
+    filled = k + 1;
+    eof = n < BATCH;
+    cv.notify_all();
+  }
+
+  for (auto& t : threads)
+    t.join();
+}
+
+void runMulti(int argc, char** argv) {
+
+  parseOptions(argc, argv);
+
+  SeqLib::BamReader reader;
+  BXOPEN(reader, opt::bam);
+  SeqLib::BamHeader hdr = reader.Header();
+
+  // each analysis parses its own options, and gets its own output
+  std::vector<std::unique_ptr<std::ofstream> > outs;
+  std::vector<std::unique_ptr<BXVisitor> > visitors;
+  auto open = [&](const std::string& fn) -> std::ostream& {
+    outs.push_back(std::unique_ptr<std::ofstream>(new std::ofstream(fn)));
+    if (!*outs.back()) {
+      std::cerr << "Could not open output file " << fn << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    return *outs.back();
+  };
+  if (!opt::stats.empty()) {
+    BXSubArgs a("stats", opt::stats_args);
+    visitors.push_back(std::unique_ptr<BXVisitor>(NewStatVisitor(a.argc(), a.argv(), open(opt::stats))));
+  }
+  if (!opt::tile.empty()) {
+    BXSubArgs a("tile", opt::tile_args);
+    visitors.push_back(std::unique_ptr<BXVisitor>(NewTileVisitor(a.argc(), a.argv(), hdr, open(opt::tile))));
+  }
+  if (!opt::mol.empty()) {
+    BXSubArgs a("mol", opt::mol_args);
+    visitors.push_back(std::unique_ptr<BXVisitor>(NewMolVisitor(a.argc(), a.argv(), hdr, open(opt::mol))));
+  }
+
+  std::vector<BXVisitor*> v;
+  for (auto& i : visitors)
+    v.push_back(i.get());
+  visitAll(reader, v);
+
+  for (auto& o : outs) {
+    o->close();
+    if (o->fail()) {
+      std::cerr << "Failed writing output" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static void parseOptions(int argc, char** argv) {
+
+  bool die = false;
+  bool help = false;
+
+  if (argc < 2) 
+    die = true;
+  else
+    opt::bam = std::string(argv[1]);
+
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v': opt::verbose = true; break;
+    case 'h': help = true; break;
+    case 'S': arg >> opt::stats; break;
+    case 'T': arg >> opt::tile; break;
+    case 'M': arg >> opt::mol; break;
+    case 's': opt::stats_args = optarg; break;
+    case 't': opt::tile_args = optarg; break;
+    case 'm': opt::mol_args = optarg; break;
+    }
+  }
+
+  if (!die && !help && opt::stats.empty() && opt::tile.empty() && opt::mol.empty()) {
+    std::cerr << "Nothing to do: give at least one of -S, -T or -M" << std::endl;
+    die = true;
+  }
+  
+  if (die || help) {
+    std::cerr << "\n" << MULTI_USAGE_MESSAGE;
+    die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
+  }
+  
+}
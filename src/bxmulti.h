@@ -0,0 +1,6 @@
+#ifndef BXTOOLS_BXMULTI_H__
+#define BXTOOLS_BXMULTI_H__
+
+void runMulti(int argc, char** argv);
+
+#endif
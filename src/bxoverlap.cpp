@@ -0,0 +1,467 @@
+#include "bxoverlap.h"
+
+#include <getopt.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "SeqLib/SeqLibUtils.h"
+
+#include "bxcommon.h"
+#include "bxmatrix.h"
+
+namespace opt {
+
+  static std::string matrix; // tile x barcode matrix from tile -o
+  static bool verbose = false;
+  static std::string pairs; // BEDPE of candidate region pairs
+  static int dist = 100000; // min gap between two tiles on one chromosome
+  static size_t top = 1000; // pairs to write, 0 for all
+  static int min_shared = 2; // min barcodes in common to report a pair
+  static int min_reads = 1; // reads of a barcode for it to count in a tile
+  static int max_tiles = 500; // ignore barcodes in more tiles than this
+}
+
+static const char* shortopts = "hvp:d:k:n:m:M:";
+static const struct option longopts[] = {
+  { "help",                    no_argument, NULL, 'h' },
+  { "verbose",                 no_argument, NULL, 'v' },
+  { "pairs",                   required_argument, NULL, 'p' },
+  { "dist",                    required_argument, NULL, 'd' },
+  { "top",                     required_argument, NULL, 'k' },
+  { "min-shared",              required_argument, NULL, 'n' },
+  { "min-reads",               required_argument, NULL, 'm' },
+  { "max-tiles",               required_argument, NULL, 'M' },
+  { NULL, 0, NULL, 0 }
+};
+
+static const char *OVERLAP_USAGE_MESSAGE =
+"Usage: bxtools overlap <matrix.bxm> > pairs.bedpe\n"
+"Description: Count barcodes shared between pairs of tiles, from the matrix written by bxtools tile -o.\n"
+"             Writes chr1 start1 end1 chr2 start2 end2, barcodes shared, barcodes in each tile,\n"
+"             most shared first\n"
+"\n"
+"  General options\n"
+"  -v, --verbose                        Set verbose output\n"
+"  -p, --pairs                          Only count these pairs of regions (BEDPE). Regions covering several\n"
+"                                       tiles get the union of their barcodes. Default is every pair of tiles\n"
+"  -d, --dist                           Skip pairs of tiles on one chromosome closer than this [100,000]\n"
+"  -k, --top                            Write the pairs with the most shared barcodes, 0 for all [1,000]\n"
+"  -n, --min-shared                     Without -p, only write pairs with this many shared barcodes [2]\n"
+"  -m, --min-reads                      Count a barcode in a tile only if it has this many reads there [1]\n"
+"  -M, --max-tiles                      Without -p, ignore barcodes found in more than this many tiles [500]\n"
+"\n";
+
+static void parseOptions(int argc, char** argv);
+
+size_t BXIntersectCount(const uint32_t* a, size_t na, const uint32_t* b, size_t nb) {
+
+  size_t i = 0, j = 0, n = 0;
+
+#ifdef __SSE2__
+  // compare a block of four from each against all four rotations of the
+  // other. The block with the smaller last value can't match anything past
+  // the other block, so it is the one to move on (both, on a tie)
+  const size_t na4 = na & ~(size_t)3;
+  const size_t nb4 = nb & ~(size_t)3;
+  while (i < na4 && j < nb4) {
+    const __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    const __m128i vb = _mm_loadu_si128((const __m128i*)(b + j));
+    const __m128i m0 = _mm_cmpeq_epi32(va, vb);
+    const __m128i m1 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)));
+    const __m128i m2 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2)));
+    const __m128i m3 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)));
+    const __m128i m = _mm_or_si128(_mm_or_si128(m0, m1), _mm_or_si128(m2, m3));
+    n += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(m)));
+    const uint32_t amax = a[i + 3];
+    const uint32_t bmax = b[j + 3];
+    if (amax <= bmax)
+      i += 4;
+    if (bmax <= amax)
+      j += 4;
+  }
+#endif
+
+  // the rest (or everything, without SSE2) as a plain merge
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      ++i;
+    } else if (b[j] < a[i]) {
+      ++j;
+    } else {
+      ++n;
+      ++i;
+      ++j;
+    }
+  }
+  return n;
+}
+
+// The tiles of a matrix and the barcodes in each, as ascending arrays of
+// matrix columns
+struct BXTileSets {
+
+  std::vector<BXMatrixTile> tiles;
+  std::vector<uint64_t> rowptr; // start of each tile's barcodes in cols
+  std::vector<uint32_t> cols;
+  std::vector<size_t> chr_end; // one past the last tile on each tile's chromosome
+  int max_width = 0;
+
+  size_t size() const { return tiles.size(); }
+
+  const uint32_t* Row(size_t i) const { return cols.data() + rowptr[i]; }
+
+  size_t RowSize(size_t i) const { return rowptr[i + 1] - rowptr[i]; }
+
+  // load the matrix, keeping barcodes with at least min_reads reads in a tile
+  void Load(const BXMatrix& m, uint32_t min_reads) {
+    std::vector<std::pair<uint32_t, uint32_t> > row;
+    tiles.reserve(m.NumTiles());
+    rowptr.reserve(m.NumTiles() + 1);
+    rowptr.push_back(0);
+    for (uint64_t i = 0; i < m.NumTiles(); ++i) {
+      const BXMatrixTile t = m.Tile(i);
+      if (i && (t.chr < tiles.back().chr || (t.chr == tiles.back().chr && t.pos1 < tiles.back().pos1))) {
+	std::cerr << "Tiles of " << opt::matrix << " are not in genome order" << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      tiles.push_back(t);
+      max_width = std::max(max_width, t.pos2 - t.pos1);
+      m.Row(i, row);
+      for (const auto& c : row)
+	if (c.second >= min_reads)
+	  cols.push_back(c.first);
+      rowptr.push_back(cols.size());
+    }
+
+    chr_end.resize(tiles.size());
+    for (size_t i = tiles.size(); i-- > 0;)
+      chr_end[i] = (i + 1 == tiles.size() || tiles[i + 1].chr != tiles[i].chr) ? i + 1 : chr_end[i + 1];
+  }
+
+  // tiles overlapping [pos1, pos2) on chr
+  void Find(int chr, int pos1, int pos2, std::vector<size_t>& out) const {
+    out.clear();
+    BXMatrixTile key;
+    key.chr = chr;
+    key.pos1 = pos1 - max_width;
+    auto it = std::lower_bound(tiles.begin(), tiles.end(), key, [](const BXMatrixTile& a, const BXMatrixTile& b) {
+	return a.chr < b.chr || (a.chr == b.chr && a.pos1 < b.pos1);
+      });
+    for (; it != tiles.end() && it->chr == chr && it->pos1 < pos2; ++it)
+      if (it->pos2 > pos1)
+	out.push_back(it - tiles.begin());
+  }
+};
+
+// a pair of tiles (or of -p lines) and the barcodes they share
+struct BXPair {
+  uint32_t shared;
+  uint32_t a;
+  uint32_t b;
+};
+
+// more shared first, then in genome (or input) order
+static bool better(const BXPair& x, const BXPair& y) {
+  return x.shared > y.shared || (x.shared == y.shared && (x.a < y.a || (x.a == y.a && x.b < y.b)));
+}
+
+// keeps the opt::top best pairs offered, or all of them if top is 0
+class BXTopPairs {
+
+ public:
+
+  void Offer(const BXPair& p) {
+    if (!opt::top) {
+      m_all.push_back(p);
+    } else if (m_heap.size() < opt::top) {
+      m_heap.push(p);
+    } else if (better(p, m_heap.top())) {
+      m_heap.pop();
+      m_heap.push(p);
+    }
+  }
+
+  // move the pairs kept onto out
+  void Take(std::vector<BXPair>& out) {
+    out.insert(out.end(), m_all.begin(), m_all.end());
+    std::vector<BXPair>().swap(m_all);
+    for (; !m_heap.empty(); m_heap.pop())
+      out.push_back(m_heap.top());
+  }
+
+ private:
+
+  typedef bool (*Better)(const BXPair&, const BXPair&);
+
+  std::vector<BXPair> m_all;
+  std::priority_queue<BXPair, std::vector<BXPair>, Better> m_heap{better}; // worst on top
+
+};
+
+static void appendRegion(std::string& out, const BXMatrix& m, int chr, int pos1, int pos2) {
+  out += m.ChrName(chr);
+  out.push_back('\t');
+  out += std::to_string(pos1);
+  out.push_back('\t');
+  out += std::to_string(pos2);
+  out.push_back('\t');
+}
+
+// Every pair of tiles at least opt::dist apart that share opt::min_shared
+// barcodes, counted through an inverted index from barcode to tiles rather
+// than by intersecting every pair. Tiles after tile i that are far enough
+// from it are, in genome order, all the tiles from far[i] on, so each list
+// of tiles is cut with one binary search. Tiles are shared out between
+// threads, each counting into its own array
+static void scanAll(const BXTileSets& s, uint64_t ncols, std::vector<BXPair>& out) {
+
+  // barcode -> tiles, ascending, leaving out the barcodes in too many tiles
+  std::vector<uint64_t> postptr(ncols + 1, 0);
+  for (const auto& c : s.cols)
+    ++postptr[c + 1];
+  size_t skipped = 0;
+  for (uint64_t c = 0; c < ncols; ++c) {
+    if (postptr[c + 1] > (uint64_t)opt::max_tiles) {
+      postptr[c + 1] = 0;
+      ++skipped;
+    }
+    postptr[c + 1] += postptr[c];
+  }
+  std::vector<uint32_t> post(postptr[ncols]);
+  {
+    std::vector<uint64_t> fill(postptr.begin(), postptr.end() - 1);
+    for (size_t i = 0; i < s.size(); ++i)
+      for (size_t k = 0; k < s.RowSize(i); ++k) {
+	const uint32_t c = s.Row(i)[k];
+	if (fill[c] < postptr[c + 1])
+	  post[fill[c]++] = i;
+      }
+  }
+  if (opt::verbose)
+    std::cerr << "...indexed " << SeqLib::AddCommas(post.size()) << " tile barcodes, skipping "
+	      << SeqLib::AddCommas(skipped) << " barcodes in more than " << opt::max_tiles << " tiles" << std::endl;
+
+  // first tile far enough after each tile
+  std::vector<uint32_t> far(s.size());
+  for (size_t i = 0; i < s.size(); ++i) {
+    const int64_t from = (int64_t)s.tiles[i].pos2 + opt::dist;
+    size_t lo = i + 1, hi = s.chr_end[i];
+    while (lo < hi) {
+      const size_t mid = (lo + hi) / 2;
+      if (s.tiles[mid].pos1 < from)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+    far[i] = lo;
+  }
+
+  const int nthreads = std::max(1, bxtools::threads);
+  std::vector<BXTopPairs> tops(nthreads);
+  std::atomic<size_t> next(0);
+
+  auto worker = [&](int t) {
+    std::vector<uint32_t> count(s.size(), 0);
+    std::vector<uint32_t> touched;
+    for (size_t i = next++; i < s.size(); i = next++) {
+      for (size_t k = 0; k < s.RowSize(i); ++k) {
+	const uint32_t c = s.Row(i)[k];
+	const uint32_t* p = std::lower_bound(post.data() + postptr[c], post.data() + postptr[c + 1], far[i]);
+	for (const uint32_t* e = post.data() + postptr[c + 1]; p < e; ++p)
+	  if (count[*p]++ == 0)
+	    touched.push_back(*p);
+      }
+      for (const auto& j : touched) {
+	if (count[j] >= (uint32_t)opt::min_shared) {
+	  BXPair pr = { count[j], (uint32_t)i, j };
+	  tops[t].Offer(pr);
+	}
+	count[j] = 0;
+      }
+      touched.clear();
+    }
+  };
+
+  if (nthreads == 1) {
+    worker(0);
+  } else {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; ++t)
+      threads.push_back(std::thread(worker, t));
+    for (auto& t : threads)
+      t.join();
+  }
+
+  for (auto& t : tops)
+    t.Take(out);
+  std::sort(out.begin(), out.end(), better);
+  if (opt::top && out.size() > opt::top)
+    out.resize(opt::top);
+}
+
+// one line of a -p file
+struct BXRegionPair {
+  int chr[2];
+  int pos1[2];
+  int pos2[2];
+  uint32_t n[2]; // barcodes in each
+};
+
+// Count the barcodes shared by each pair of regions in a BEDPE file, by
+// intersecting their sorted barcode arrays
+static void countPairs(const BXMatrix& m, const BXTileSets& s, std::vector<BXRegionPair>& regions,
+		       std::vector<BXPair>& out) {
+
+  std::ifstream in(opt::pairs);
+  if (!in) {
+    std::cerr << "Could not open pairs file " << opt::pairs << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  std::unordered_map<std::string, int> chrs;
+  for (const auto& t : s.tiles)
+    chrs[m.ChrName(t.chr)] = t.chr;
+
+  BXTopPairs top;
+  std::vector<size_t> found;
+  std::vector<uint32_t> merged[2];
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#' || !line.compare(0, 5, "track"))
+      continue;
+    std::istringstream ss(line);
+    std::string chr[2];
+    BXRegionPair r;
+    if (!(ss >> chr[0] >> r.pos1[0] >> r.pos2[0] >> chr[1] >> r.pos1[1] >> r.pos2[1])) {
+      std::cerr << "Could not parse pairs line: " << line << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    // the barcodes of each region. A single tile is used in place
+    const uint32_t* set[2];
+    size_t n[2];
+    for (int k = 0; k < 2; ++k) {
+      auto ff = chrs.find(chr[k]);
+      r.chr[k] = ff == chrs.end() ? -1 : ff->second;
+      found.clear();
+      if (r.chr[k] >= 0)
+	s.Find(r.chr[k], r.pos1[k], r.pos2[k], found);
+      if (found.size() == 1) {
+	set[k] = s.Row(found[0]);
+	n[k] = s.RowSize(found[0]);
+      } else {
+	merged[k].clear();
+	for (const auto& i : found)
+	  merged[k].insert(merged[k].end(), s.Row(i), s.Row(i) + s.RowSize(i));
+	std::sort(merged[k].begin(), merged[k].end());
+	merged[k].erase(std::unique(merged[k].begin(), merged[k].end()), merged[k].end());
+	set[k] = merged[k].data();
+	n[k] = merged[k].size();
+      }
+      r.n[k] = n[k];
+    }
+
+    BXPair p = { (uint32_t)BXIntersectCount(set[0], n[0], set[1], n[1]), (uint32_t)regions.size(), 0 };
+    regions.push_back(r);
+    top.Offer(p);
+  }
+
+  top.Take(out);
+  std::sort(out.begin(), out.end(), better);
+}
+
+void runOverlap(int argc, char** argv) {
+
+  parseOptions(argc, argv);
+
+  BXMatrix m;
+  if (!m.Open(opt::matrix)) {
+    std::cerr << "Could not read tile matrix " << opt::matrix << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  BXTileSets s;
+  s.Load(m, opt::min_reads);
+  if (opt::verbose)
+    std::cerr << "...loaded " << SeqLib::AddCommas(s.size()) << " tiles with "
+	      << SeqLib::AddCommas(s.cols.size()) << " tile barcodes" << std::endl;
+
+  std::vector<BXPair> pairs;
+  std::vector<BXRegionPair> regions;
+  if (opt::pairs.empty())
+    scanAll(s, m.NumBarcodes(), pairs);
+  else
+    countPairs(m, s, regions, pairs);
+
+  std::string out;
+  for (const auto& p : pairs) {
+    if (opt::pairs.empty()) {
+      const BXMatrixTile& a = s.tiles[p.a];
+      const BXMatrixTile& b = s.tiles[p.b];
+      appendRegion(out, m, a.chr, a.pos1, a.pos2);
+      appendRegion(out, m, b.chr, b.pos1, b.pos2);
+      out += std::to_string(p.shared) + "\t" + std::to_string(s.RowSize(p.a)) + "\t" + std::to_string(s.RowSize(p.b)) + "\n";
+    } else {
+      const BXRegionPair& r = regions[p.a];
+      for (int k = 0; k < 2; ++k) {
+	out += r.chr[k] < 0 ? std::string("NA") : std::string(m.ChrName(r.chr[k]));
+	out += "\t" + std::to_string(r.pos1[k]) + "\t" + std::to_string(r.pos2[k]) + "\t";
+      }
+      out += std::to_string(p.shared) + "\t" + std::to_string(r.n[0]) + "\t" + std::to_string(r.n[1]) + "\n";
+    }
+    if (out.size() >= (1 << 20)) {
+      std::cout.write(out.data(), out.size());
+      out.clear();
+    }
+  }
+  std::cout.write(out.data(), out.size());
+  std::cout.flush();
+}
+
+static void parseOptions(int argc, char** argv) {
+
+  bool die = false;
+  bool help = false;
+
+  if (argc < 2)
+    die = true;
+  else
+    opt::matrix = std::string(argv[1]);
+
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v': opt::verbose = true; break;
+    case 'h': help = true; break;
+    case 'p': arg >> opt::pairs; break;
+    case 'd': arg >> opt::dist; break;
+    case 'k': arg >> opt::top; break;
+    case 'n': arg >> opt::min_shared; break;
+    case 'm': arg >> opt::min_reads; break;
+    case 'M': arg >> opt::max_tiles; break;
+    }
+  }
+
+  if (opt::min_reads < 1) {
+    std::cerr << "Min reads (-m) should be at least 1: " << opt::min_reads << std::endl;
+    die = true;
+  }
+
+  if (die || help) {
+    std::cerr << "\n" << OVERLAP_USAGE_MESSAGE;
+    die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
+  }
+}
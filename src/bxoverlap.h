@@ -0,0 +1,13 @@
+#ifndef BXTOOLS_BXOVERLAP_H__
+#define BXTOOLS_BXOVERLAP_H__
+
+#include <cstdint>
+#include <cstddef>
+
+void runOverlap(int argc, char** argv);
+
+// number of values in both of two ascending arrays of distinct values.
+// Compares four at a time with SSE2 where available
+size_t BXIntersectCount(const uint32_t* a, size_t na, const uint32_t* b, size_t nb);
+
+#endif
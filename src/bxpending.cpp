@@ -0,0 +1,137 @@
+#include "bxpending.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "bxsort.h"
+
+BXPending::BXPending(size_t max_mem, const std::string& prefix) 
+  : m_max(std::max(max_mem, (size_t)1 << 20)), m_prefix(prefix), m_b(bam_init1()) {}
+
+BXPending::~BXPending() {
+  for (auto& r : m_readers)
+    if (r)
+      bgzf_close(r);
+  for (const auto& f : m_files)
+    std::remove(f.c_str());
+  bam_destroy1(m_b);
+}
+
+void BXPending::Add(List& l, const bam1_t* b) {
+
+  const size_t need = sizeof(Entry) + sizeof(bam1_core_t) + b->l_data;
+  if (m_arena.size() + need > m_max && m_lists.size())
+    spill();
+
+  // grow by doubling, but not past the budget, so a small input only
+  // takes what it holds back
+  const uint64_t off = m_arena.size();
+  if (off + need > m_arena.capacity())
+    m_arena.reserve(std::max<size_t>(off + need, std::min(2 * m_arena.capacity(), m_max)));
+  m_arena.resize(off + need);
+  char* p = &m_arena[off];
+  Entry e;
+  e.next = NIL;
+  e.dlen = b->l_data;
+  memcpy(p, &e, sizeof(Entry));
+  memcpy(p + sizeof(Entry), &b->core, sizeof(bam1_core_t));
+  memcpy(p + sizeof(Entry) + sizeof(bam1_core_t), b->data, b->l_data);
+
+  if (l.head == NIL) {
+    l.head = off;
+    m_lists.push_back(&l);
+  } else {
+    memcpy(&m_arena[l.tail], &off, sizeof(uint64_t)); // link from the old tail
+  }
+  l.tail = off;
+}
+
+void BXPending::Replay(List& l, const Visitor& f) {
+
+  for (const auto& r : l.runs) {
+    if (m_readers.size() <= r.file)
+      m_readers.resize(r.file + 1, nullptr);
+    BGZF*& fp = m_readers[r.file];
+    if (!fp && !(fp = bgzf_open(m_files[r.file].c_str(), "r"))) {
+      std::cerr << "Could not open temporary file: " << m_files[r.file] << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (bgzf_seek(fp, r.voff, SEEK_SET) < 0) {
+      std::cerr << "Could not seek in temporary file: " << m_files[r.file] << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::vector<char> buf;
+    for (uint32_t i = 0; i < r.n; ++i) {
+      uint32_t dlen;
+      if (bgzf_read(fp, &dlen, sizeof(dlen)) != sizeof(dlen)) {
+	std::cerr << "Truncated temporary file: " << m_files[r.file] << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      buf.resize(sizeof(bam1_core_t) + dlen);
+      if (bgzf_read(fp, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+	std::cerr << "Truncated temporary file: " << m_files[r.file] << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      BXLoadRecord(m_b, buf.data(), dlen);
+      f(m_b);
+    }
+  }
+  std::vector<Run>().swap(l.runs);
+
+  // the arena space is only reclaimed on the next spill
+  for (uint64_t off = l.head; off != NIL;) {
+    Entry e;
+    memcpy(&e, &m_arena[off], sizeof(Entry));
+    BXLoadRecord(m_b, &m_arena[off + sizeof(Entry)], e.dlen);
+    f(m_b);
+    off = e.next;
+  }
+  l.head = l.tail = NIL;
+}
+
+void BXPending::spill() {
+
+  const std::string fn = m_prefix + "." + std::to_string(getpid()) + "." + 
+    std::to_string(m_files.size()) + ".tmp";
+  BGZF* fp = bgzf_open(fn.c_str(), "w1");
+  if (!fp) {
+    std::cerr << "Could not open temporary file: " << fn << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  // single threaded, so bgzf_tell gives the offsets to seek back to
+  const uint32_t file = m_files.size();
+  m_files.push_back(fn);
+
+  // each record is stored as: data length, core, data
+  for (auto l : m_lists) {
+    if (l->head == NIL) // replayed since
+      continue;
+    Run run;
+    run.file = file;
+    run.n = 0;
+    run.voff = bgzf_tell(fp);
+    for (uint64_t off = l->head; off != NIL; ++run.n) {
+      Entry e;
+      memcpy(&e, &m_arena[off], sizeof(Entry));
+      if (bgzf_write(fp, &e.dlen, sizeof(e.dlen)) < 0 ||
+	  bgzf_write(fp, &m_arena[off + sizeof(Entry)], sizeof(bam1_core_t) + e.dlen) < 0) {
+	std::cerr << "Failed writing temporary file: " << fn << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      off = e.next;
+    }
+    l->runs.push_back(run);
+    l->head = l->tail = NIL;
+  }
+  if (bgzf_close(fp) < 0) {
+    std::cerr << "Failed closing temporary file: " << fn << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  m_lists.clear();
+  m_arena.clear();
+}
@@ -0,0 +1,80 @@
+#ifndef BXTOOLS_BXPENDING_H__
+#define BXTOOLS_BXPENDING_H__
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+#include "htslib/sam.h"
+#include "htslib/bgzf.h"
+
+// Reads held back per barcode (e.g. until split sees --min-reads of it),
+// under a fixed memory budget. Records go into one arena, chained per
+// barcode, that grows up to the budget as it is needed. When the arena is
+// full, every chain still in it is written to a temporary BGZF file,
+// contiguously per barcode, and the arena starts over.
+// Replay() hands a barcode's reads back in the order they were added:
+// first from the spill files, then from the arena
+class BXPending {
+
+ public:
+
+  // a barcode's reads in one spill file
+  struct Run {
+    uint32_t file;
+    uint32_t n;    // number of records
+    uint64_t voff; // BGZF virtual offset of the first
+  };
+
+  // the reads of one barcode. Must stay at the same address while it
+  // holds reads (e.g. a value in an unordered_map)
+  struct List {
+    uint64_t head = NIL; // first and last record in the arena
+    uint64_t tail = NIL;
+    std::vector<Run> runs;
+    bool empty() const { return head == NIL && runs.empty(); }
+  };
+
+  // called for each record on Replay. The record is only valid for the
+  // duration of the call
+  typedef std::function<void(bam1_t* b)> Visitor;
+
+  BXPending(size_t max_mem, const std::string& prefix);
+
+  ~BXPending();
+
+  void Add(List& l, const bam1_t* b);
+
+  // visit the reads of l in order, and release them
+  void Replay(List& l, const Visitor& f);
+
+  size_t NumSpills() const { return m_files.size(); }
+  
+ private:
+
+  static const uint64_t NIL = UINT64_MAX;
+
+  // arena entry: offset of the next entry of the list, data length, then
+  // the core and data of the record
+  struct Entry {
+    uint64_t next;
+    uint32_t dlen;
+  };
+  
+  size_t m_max;
+  std::string m_prefix;
+  std::vector<char> m_arena;
+  std::vector<List*> m_lists; // lists with reads in the arena
+  std::vector<std::string> m_files;
+  std::vector<BGZF*> m_readers; // opened on the first replay from a file
+  bam1_t* m_b;
+
+  BXPending(const BXPending&);
+  BXPending& operator=(const BXPending&);
+  
+  void spill();
+  
+};
+
+#endif
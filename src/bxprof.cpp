@@ -0,0 +1,105 @@
+#include "bxprof.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <sys/resource.h>
+
+#include "SeqLib/SeqLibUtils.h"
+
+#include "bxcommon.h"
+
+namespace bxtools {
+
+  std::string stats_json;
+
+  int progress = 0;
+
+  BXProfile& Profile() {
+    static BXProfile prof;
+    return prof;
+  }
+}
+
+static const char* PHASE_NAMES[BXPHASE_N] = { "decode", "tag", "map", "write" };
+
+// peak resident set, in kB
+static long peakRSS() {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0)
+    return -1;
+  return ru.ru_maxrss; 
+}
+
+static double seconds(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::duration<double> >(d).count();
+}
+
+void BXProfile::Start(const std::string& command) {
+  m_command = command;
+  m_json = bxtools::stats_json;
+  m_progress = bxtools::progress;
+  m_on = !m_json.empty() || m_progress > 0;
+  for (auto& n : m_ns)
+    n = 0;
+  m_start = Clock::now();
+  m_last = m_start.time_since_epoch().count();
+}
+
+void BXProfile::progress() {
+  const Clock::time_point now = Clock::now();
+  auto due = [&]() {
+    const Clock::time_point last(Clock::duration(m_last.load(std::memory_order_relaxed)));
+    return seconds(now - last) >= m_progress;
+  };
+  if (!due())
+    return;
+  std::lock_guard<std::mutex> lock(m_mtx);
+  if (!due()) // another thread got here first
+    return;
+  m_last.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+  const double t = seconds(now - m_start);
+  const uint64_t reads = m_reads;
+  std::cerr << "...[" << m_command << "] " << SeqLib::AddCommas(reads) << " reads in " 
+	    << (int)t << "s, " << SeqLib::AddCommas((uint64_t)(reads / t)) << " reads/s, "
+	    << (int)(m_bytes_in / t / 1e6) << " MB/s in, peak RSS " 
+	    << SeqLib::AddCommas(peakRSS() / 1024) << " MB" << std::endl;
+}
+
+void BXProfile::Finish() {
+
+  if (m_json.empty())
+    return;
+
+  const double t = seconds(Clock::now() - m_start);
+  std::stringstream ss;
+  ss << "{\n"
+     << "  \"command\": \"" << m_command << "\",\n"
+     << "  \"threads\": " << bxtools::threads << ",\n"
+     << "  \"seconds\": " << t << ",\n"
+     << "  \"reads\": " << m_reads << ",\n"
+     << "  \"reads_per_second\": " << (t > 0 ? m_reads / t : 0) << ",\n"
+     << "  \"bytes_in\": " << m_bytes_in << ",\n"
+     << "  \"bytes_out\": " << m_bytes_out << ",\n"
+     << "  \"phase_seconds\": {";
+  for (int i = 0; i < BXPHASE_N; ++i)
+    ss << (i ? ", " : " ") << "\"" << PHASE_NAMES[i] << "\": " << m_ns[i] / 1e9;
+  ss << " },\n"
+     << "  \"peak_rss_kb\": " << peakRSS() << ",\n"
+     << "  \"maps\": [";
+  for (size_t i = 0; i < m_maps.size(); ++i)
+    ss << (i ? "," : "") << "\n    { \"name\": \"" << m_maps[i].name << "\", \"size\": " << m_maps[i].size
+       << ", \"buckets\": " << m_maps[i].buckets << ", \"load_factor\": " << m_maps[i].load << " }";
+  ss << (m_maps.empty() ? "" : "\n  ") << "]\n}\n";
+
+  if (m_json == "-") {
+    std::cerr << ss.str();
+    return;
+  }
+  std::ofstream out(m_json);
+  if (!out || !(out << ss.str())) {
+    std::cerr << "Could not write stats report " << m_json << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
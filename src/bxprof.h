@@ -0,0 +1,148 @@
+#ifndef BXTOOLS_BXPROF_H__
+#define BXTOOLS_BXPROF_H__
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "SeqLib/BamReader.h"
+
+// where the time of a command goes
+enum BXPhase {
+  BXPHASE_DECODE, // reading and decompressing records
+  BXPHASE_TAG,    // looking up the barcode tag
+  BXPHASE_MAP,    // barcode dictionary and hash map updates
+  BXPHASE_WRITE,  // writing output records
+  BXPHASE_N
+};
+
+// Run-wide counters for --stats-json and --progress: reads and bytes in
+// and out, time per phase, peak RSS and the size of the big hash maps.
+// Everything is a no-op unless one of the two options is given. Counters
+// are atomic, so workers can add to them
+class BXProfile {
+
+ public:
+
+  BXProfile() {}
+
+  // start the clock. Called by main
+  void Start(const std::string& command);
+
+  bool On() const { return m_on; }
+
+  // one record read, of this many decompressed bytes
+  void Read(size_t bytes) {
+    if (!m_on)
+      return;
+    m_bytes_in.fetch_add(bytes, std::memory_order_relaxed);
+    if ((m_reads.fetch_add(1, std::memory_order_relaxed) & 0xffff) == 0xffff && m_progress > 0)
+      progress();
+  }
+
+  void Wrote(size_t bytes) {
+    if (m_on)
+      m_bytes_out.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  void Add(BXPhase p, uint64_t ns) {
+    m_ns[p].fetch_add(ns, std::memory_order_relaxed);
+  }
+
+  // note the size of a hash map, at the end of a command
+  template <class M>
+  void Map(const std::string& name, const M& m) {
+    if (!m_on)
+      return;
+    BXMapStat s;
+    s.name = name;
+    s.size = m.size();
+    s.buckets = m.bucket_count();
+    s.load = m.load_factor();
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_maps.push_back(s);
+  }
+
+  // write the JSON report, if asked for. Called by main
+  void Finish();
+
+ private:
+
+  struct BXMapStat {
+    std::string name;
+    size_t size;
+    size_t buckets;
+    float load;
+  };
+
+  typedef std::chrono::steady_clock Clock;
+
+  bool m_on = false;
+  int m_progress = 0;
+  std::string m_json;
+  std::string m_command;
+  Clock::time_point m_start;
+  std::atomic<Clock::rep> m_last{0}; // clock ticks at the last progress line, checked without the lock
+  std::atomic<uint64_t> m_reads{0};
+  std::atomic<uint64_t> m_bytes_in{0};
+  std::atomic<uint64_t> m_bytes_out{0};
+  std::atomic<uint64_t> m_ns[BXPHASE_N];
+  std::mutex m_mtx;
+  std::vector<BXMapStat> m_maps;
+
+  void progress();
+  
+};
+
+namespace bxtools {
+
+  // JSON report file ("-" for stderr). Set by --stats-json in main()
+  extern std::string stats_json;
+
+  // seconds between progress lines, 0 for none. Set by --progress in main()
+  extern int progress;
+
+  BXProfile& Profile();
+}
+
+// time a scope as one phase, when profiling
+class BXPhaseTimer {
+
+ public:
+
+  explicit BXPhaseTimer(BXPhase p) : m_phase(p), m_on(bxtools::Profile().On()) {
+    if (m_on)
+      m_start = std::chrono::steady_clock::now();
+  }
+
+  ~BXPhaseTimer() { Stop(); }
+
+  // end the phase before the end of the scope
+  void Stop() {
+    if (m_on)
+      bxtools::Profile().Add(m_phase, std::chrono::duration_cast<std::chrono::nanoseconds>
+			     (std::chrono::steady_clock::now() - m_start).count());
+    m_on = false;
+  }
+
+ private:
+
+  BXPhase m_phase;
+  bool m_on;
+  std::chrono::steady_clock::time_point m_start;
+  
+};
+
+// GetNextRecord, counted and timed as decode
+inline bool BXNextRecord(SeqLib::BamReader& reader, SeqLib::BamRecord& r) {
+  BXPhaseTimer t(BXPHASE_DECODE);
+  if (!reader.GetNextRecord(r))
+    return false;
+  bxtools::Profile().Read(sizeof(bam1_core_t) + r.raw()->l_data);
+  return true;
+}
+
+#endif
@@ -0,0 +1,120 @@
+#include "bxraw.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+
+// make room for at least n bytes of data
+static bool reserve(bam1_t* b, size_t n) {
+  if (n <= b->m_data)
+    return true;
+  size_t m = b->m_data ? b->m_data : 64;
+  while (m < n)
+    m <<= 1;
+  uint8_t* d = (uint8_t*)realloc(b->data, m);
+  if (!d)
+    return false;
+  b->data = d;
+  b->m_data = m;
+  return true;
+}
+
+// replace bytes [pos, pos + len) of the data with a gap of new_len bytes,
+// shifting everything after. The gap is left uninitialised, and there must
+// be room for it
+static void splice(bam1_t* b, size_t pos, size_t len, size_t new_len) {
+  memmove(b->data + pos + new_len, b->data + pos + len, b->l_data - pos - len);
+  b->l_data += (int)new_len - (int)len;
+}
+
+BXRawResult BXRelabelRaw(bam1_t* b, const char tag[2]) {
+
+  uint8_t* s = bam_aux_get(b, tag);
+  if (!s)
+    return BXRAW_NO_TAG;
+  if (*s != 'Z')
+    return BXRAW_SLOW;
+
+  const char* v = (const char*)s + 1;
+  const size_t vlen = strlen(v);
+  if (!vlen)
+    return BXRAW_NO_TAG;
+  const size_t name_len = b->core.l_qname - b->core.l_extranul - 1;
+  const size_t new_name_len = name_len + 1 + vlen;
+  if (new_name_len > 254)
+    return BXRAW_SLOW;
+
+  // keep the data after the name 4 byte aligned
+  const size_t extranul = (4 - (new_name_len + 1) % 4) % 4;
+  const size_t l_qname = new_name_len + 1 + extranul;
+  const size_t field = (s - 2) - b->data; // tag, type, value, NUL
+  const size_t field_len = vlen + 4;
+  if (l_qname > b->core.l_qname + field_len && 
+      !reserve(b, b->l_data + l_qname - b->core.l_qname - field_len))
+    return BXRAW_SLOW;
+
+  // the barcode has to be copied out before the data is shifted
+  char buf[256];
+  memcpy(buf, b->data + field + 3, vlen);
+  splice(b, field, field_len, 0);
+
+  // grow the name in place of its old NUL padding
+  splice(b, name_len, b->core.l_qname - name_len, l_qname - name_len);
+  char* q = (char*)b->data;
+  q[name_len] = '_';
+  memcpy(q + name_len + 1, buf, vlen);
+  memset(q + new_name_len, 0, 1 + extranul);
+  b->core.l_qname = l_qname;
+  b->core.l_extranul = extranul;
+  return BXRAW_OK;
+}
+
+BXRawResult BXUnrelabelRaw(bam1_t* b, const char tag[2]) {
+
+  char* q = (char*)b->data;
+  const size_t name_len = b->core.l_qname - b->core.l_extranul - 1;
+  size_t us = name_len;
+  while (us > 0 && q[us - 1] != '_')
+    --us;
+  if (us < 2 || us == name_len)
+    return BXRAW_NO_TAG; // no '_', nothing before it, or nothing after it
+  --us;
+
+  char buf[256];
+  const size_t vlen = name_len - us - 1;
+  memcpy(buf, q + us + 1, vlen);
+  buf[vlen] = '\0';
+
+  uint8_t* s = bam_aux_get(b, tag);
+  if (s)
+    bam_aux_del(b, s);
+
+  // shrink the name, keeping the data after it 4 byte aligned
+  const size_t extranul = (4 - (us + 1) % 4) % 4;
+  const size_t l_qname = us + 1 + extranul;
+  splice(b, us, b->core.l_qname - us, l_qname - us);
+  memset(b->data + us, 0, 1 + extranul);
+  b->core.l_qname = l_qname;
+  b->core.l_extranul = extranul;
+
+  if (bam_aux_append(b, tag, 'Z', vlen + 1, (const uint8_t*)buf) != 0) {
+    std::cerr << "Failed to add " << tag[0] << tag[1] << " tag to read " << bam_get_qname(b) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return BXRAW_OK;
+}
+
+const char* BXTagValue(const bam1_t* b, const char tag[2], char* buf, size_t n) {
+  const uint8_t* s = bam_aux_get(b, tag);
+  if (!s)
+    return nullptr;
+  switch (*s) {
+  case 'Z':
+    return (const char*)s + 1;
+  case 'c': case 'C': case 's': case 'S': case 'i': case 'I':
+    snprintf(buf, n, "%lld", (long long)bam_aux2i(s));
+    return buf;
+  }
+  return nullptr;
+}
@@ -0,0 +1,33 @@
+#ifndef BXTOOLS_BXRAW_H__
+#define BXTOOLS_BXRAW_H__
+
+#include <cstddef>
+
+#include "htslib/sam.h"
+
+// In-place edits of a raw htslib record, for the streaming transforms
+// (relabel and friends). They shift the record's data block directly rather
+// than going through BamRecord, and only touch the heap if the data block
+// has to grow.
+
+// results of the edits below
+enum BXRawResult {
+  BXRAW_OK = 0,      // edited
+  BXRAW_NO_TAG = 1,  // the tag is missing or empty, record unchanged
+  BXRAW_SLOW = 2     // can't be done in place (e.g. the tag isn't a Z string,
+                     // or the name would be too long), record unchanged
+};
+
+// Move a Z tag to the end of the read name: qname -> qname_VALUE, and drop
+// the tag from the aux data
+BXRawResult BXRelabelRaw(bam1_t* b, const char tag[2]);
+
+// The reverse: split the name at its last '_' and put what follows back in
+// a Z tag (replacing any existing one): qname_VALUE -> qname, tag:Z:VALUE
+BXRawResult BXUnrelabelRaw(bam1_t* b, const char tag[2]);
+
+// The value of a string or integer tag, or null if the record doesn't have
+// it. Integers are formatted into buf
+const char* BXTagValue(const bam1_t* b, const char tag[2], char* buf, size_t n);
+
+#endif
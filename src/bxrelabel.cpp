@@ -5,6 +5,10 @@
 #include <iostream>
 #include <sstream>
 
+#include "bxcommon.h"
+#include "bxprof.h"
+#include "bxraw.h"
+
 #include "SeqLib/BamReader.h"
 #include "SeqLib/BamWriter.h"
 
@@ -65,6 +69,7 @@ void runRelabel(int argc, char** argv) {
     std::cerr << "Failed to open bam: " << opt::bam << std::endl;
     exit(EXIT_FAILURE);
   }
+  BXTHREADS(reader)
 
   // open the write BAM
   SeqLib::BamWriter w;
@@ -72,6 +77,7 @@ void runRelabel(int argc, char** argv) {
     std::cerr << "Failed to open output stream" << std::endl;
     exit(EXIT_FAILURE);
   }
+  BXTHREADS(w)
   w.SetHeader(reader.Header());
   w.WriteHeader();
   
@@ -79,7 +85,7 @@ void runRelabel(int argc, char** argv) {
   SeqLib::BamRecord r;
   size_t count = 0;
   bool bxtaghit = false;
-  while (reader.GetNextRecord(r)) {
+  while (BXNextRecord(reader, r)) {
 
     ++count;
 
@@ -87,25 +93,37 @@ void runRelabel(int argc, char** argv) {
     if (count == 100000 && !bxtaghit)
       std::cerr << "****1e5 reads in and haven't hit BX tag yet****" << std::endl;
 
-    std::string bx;
-    r.GetZTag("BX", bx);
-    if (bx.empty()) {
-      if (opt::verbose)
-	std::cerr << "BX tag empty for read: " << r << std::endl;
-      continue;
-    } else {
-      bxtaghit = true;
-    }
-      
     if (count % 1000000 == 0 && opt::verbose)
       std::cerr << "...at read " << SeqLib::AddCommas(count) << " at pos " << r.Brief() << std::endl;
 
-    // set the read name with the BX tag, remove the old one
-    r.SetQname(r.Qname() + "_" + bx);
-    r.RemoveTag("BX");
+    // set the read name with the BX tag, remove the old one. This is done
+    // directly on the record's data, unless the tag is odd (not a string, or
+    // too long to fit in the name)
+    BXPhaseTimer tag_time(BXPHASE_TAG);
+    BXRawResult res = BXRelabelRaw(r.raw(), "BX");
+    if (res == BXRAW_SLOW) {
+      std::string bx;
+      r.GetZTag("BX", bx);
+      if (bx.empty()) 
+	res = BXRAW_NO_TAG;
+      else {
+	r.SetQname(r.Qname() + "_" + bx);
+	r.RemoveTag("BX");
+	res = BXRAW_OK;
+      }
+    }
+    if (res == BXRAW_NO_TAG) {
+      if (opt::verbose)
+	std::cerr << "BX tag empty for read: " << r << std::endl;
+      continue;
+    } 
+    bxtaghit = true;
+    tag_time.Stop();
     
+    BXPhaseTimer write_time(BXPHASE_WRITE);
+    bxtools::Profile().Wrote(sizeof(bam1_core_t) + r.raw()->l_data);
     if (!w.WriteRecord(r)) {
-      std::cerr << "failed to write read " << r << " to BAM for " << bx << std::endl;
+      std::cerr << "failed to write read " << r << " to BAM" << std::endl;
       exit(EXIT_FAILURE);
     }
   }
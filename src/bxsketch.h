@@ -0,0 +1,183 @@
+#ifndef BXTOOLS_BXSKETCH_H__
+#define BXTOOLS_BXSKETCH_H__
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+// Exact histogram over small non-negative values (e.g. MAPQ 0-255). Stored
+// sparsely as (value, count) pairs, since a barcode rarely sees more than a
+// handful of distinct values
+class BXHistogram {
+
+ public:
+
+  void Add(int v) {
+    v = std::max(0, std::min(v, 255));
+    for (auto& b : m_bins)
+      if (b.first == v) {
+	++b.second;
+	++m_n;
+	return;
+      }
+    m_bins.insert(std::upper_bound(m_bins.begin(), m_bins.end(), std::make_pair((uint8_t)v, (uint32_t)0)), 
+		  std::make_pair((uint8_t)v, (uint32_t)1));
+    ++m_n;
+  }
+
+  // add the counts of another histogram
+  void Merge(const BXHistogram& o) {
+    for (const auto& x : o.m_bins) {
+      auto b = std::lower_bound(m_bins.begin(), m_bins.end(), std::make_pair(x.first, (uint32_t)0));
+      if (b != m_bins.end() && b->first == x.first)
+	b->second += x.second;
+      else
+	m_bins.insert(b, x);
+    }
+    m_n += o.m_n;
+  }
+
+  size_t size() const { return m_n; }
+
+  // value at 0-based rank i in sorted order
+  int AtRank(uint64_t i) const {
+    for (const auto& b : m_bins) {
+      if (i < b.second)
+	return b.first;
+      i -= b.second;
+    }
+    return m_bins.empty() ? -1 : m_bins.back().first;
+  }
+
+  // median, matching the integer average of the middle pair used on raw vectors
+  double Median() const {
+    if (m_n % 2 == 0)
+      return (AtRank(m_n / 2 - 1) + AtRank(m_n / 2)) / 2;
+    return AtRank(m_n / 2);
+  }
+
+  double Quantile(double q) const {
+    return AtRank((uint64_t)(q * (m_n - 1)));
+  }
+  
+ private:
+
+  std::vector<std::pair<uint8_t, uint32_t> > m_bins;
+  uint64_t m_n = 0;
+  
+};
+
+// KLL-style streaming quantile sketch. Values are kept in a stack of levels,
+// where an item on level h stands for 2^h inputs. When the sketch is over
+// capacity the lowest full level is sorted and every other item is promoted
+// to the level above. Memory is bounded by roughly 3k items regardless of how
+// many values are added, and the sketch is exact until it first compacts
+template <class T>
+class BXQuantileSketch {
+
+ public:
+
+  BXQuantileSketch() {}
+
+  void Add(T v, uint16_t k) {
+    if (m_levels.empty())
+      m_levels.resize(1);
+    m_levels[0].push_back(v);
+    ++m_n;
+    if (m_levels[0].size() >= capacity(0, k))
+      compress(k);
+  }
+
+  // add the items of another sketch, level by level, and compact until it
+  // is back in bounds. Stays exact if neither has compacted and the sum fits
+  void Merge(const BXQuantileSketch& o, uint16_t k) {
+    if (o.m_levels.size() > m_levels.size())
+      m_levels.resize(o.m_levels.size());
+    for (size_t h = 0; h < o.m_levels.size(); ++h)
+      m_levels[h].insert(m_levels[h].end(), o.m_levels[h].begin(), o.m_levels[h].end());
+    m_n += o.m_n;
+    while (overfull(k))
+      compress(k);
+  }
+
+  size_t size() const { return m_n; }
+
+  double Median() const {
+    if (m_levels.size() == 1) { // no compaction yet, still exact
+      std::vector<T> v = m_levels[0];
+      const size_t n = v.size();
+      std::nth_element(v.begin(), v.begin() + n / 2, v.end());
+      T hi = v[n / 2];
+      if (n % 2)
+	return hi;
+      T lo = *std::max_element(v.begin(), v.begin() + n / 2);
+      return (lo + hi) / 2;
+    }
+    return Quantile(0.5);
+  }
+
+  double Quantile(double q) const {
+    std::vector<std::pair<T, uint64_t> > w;
+    uint64_t total = 0;
+    for (size_t h = 0; h < m_levels.size(); ++h)
+      for (const auto& x : m_levels[h]) {
+	w.push_back(std::make_pair(x, (uint64_t)1 << h));
+	total += (uint64_t)1 << h;
+      }
+    if (w.empty())
+      return -1;
+    std::sort(w.begin(), w.end());
+    const uint64_t rank = (uint64_t)(q * (total - 1));
+    uint64_t cum = 0;
+    for (const auto& x : w) {
+      cum += x.second;
+      if (cum > rank)
+	return x.first;
+    }
+    return w.back().first;
+  }
+  
+ private:
+
+  std::vector<std::vector<T> > m_levels;
+  uint64_t m_n = 0;
+  bool m_coin = false; // alternates which half survives a compaction
+
+  // lower levels get geometrically smaller capacities (2/3 per level)
+  size_t capacity(size_t h, uint16_t k) const {
+    size_t depth = m_levels.size() - 1 - h;
+    double c = k;
+    for (size_t i = 0; i < depth; ++i)
+      c *= 2.0 / 3.0;
+    return std::max((size_t)2, (size_t)c);
+  }
+  
+  bool overfull(uint16_t k) const {
+    for (size_t h = 0; h < m_levels.size(); ++h)
+      if (m_levels[h].size() >= capacity(h, k))
+	return true;
+    return false;
+  }
+
+  void compress(uint16_t k) {
+    for (size_t h = 0; h < m_levels.size(); ++h) {
+      if (m_levels[h].size() < capacity(h, k))
+	continue;
+      if (h + 1 == m_levels.size())
+	m_levels.resize(m_levels.size() + 1);
+      std::vector<T>& cur = m_levels[h];
+      std::sort(cur.begin(), cur.end());
+      // an odd item out stays behind on this level
+      size_t n = cur.size() - (cur.size() % 2);
+      m_coin = !m_coin;
+      for (size_t i = m_coin ? 1 : 0; i < n; i += 2)
+	m_levels[h + 1].push_back(cur[i]);
+      cur.erase(cur.begin(), cur.begin() + n);
+      cur.shrink_to_fit();
+    }
+  }
+  
+};
+
+#endif
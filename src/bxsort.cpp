@@ -0,0 +1,199 @@
+#include "bxsort.h"
+
+#include <iostream>
+#include <algorithm>
+#include <queue>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "htslib/bgzf.h"
+
+#include "bxcommon.h"
+
+BXSorter::BXSorter(size_t max_mem, const std::string& prefix) 
+  : m_max(std::max(max_mem, (size_t)1 << 20)), m_prefix(prefix) {}
+
+BXSorter::~BXSorter() {
+  removeRuns();
+}
+
+void BXSorter::removeRuns() {
+  for (const auto& f : m_runs)
+    std::remove(f.c_str());
+  m_runs.clear();
+}
+
+void BXSorter::fail(const std::string& msg) {
+  std::cerr << msg << std::endl;
+  removeRuns(); // exit() skips the destructor
+  exit(EXIT_FAILURE);
+}
+
+void BXSorter::Add(const char* key, size_t klen, const bam1_t* b) {
+
+  const size_t need = klen + sizeof(bam1_core_t) + b->l_data;
+  if (m_arena.size() + need > m_max && m_entries.size())
+    spill();
+
+  // grow by doubling, but not past the budget, so a small input only
+  // takes what it holds
+  Entry e;
+  e.off = m_arena.size();
+  e.klen = klen;
+  e.dlen = b->l_data;
+  if (e.off + need > m_arena.capacity())
+    m_arena.reserve(std::max<size_t>(e.off + need, std::min(2 * m_arena.capacity(), m_max)));
+  m_arena.resize(e.off + need);
+  char* p = &m_arena[e.off];
+  memcpy(p, key, klen);
+  memcpy(p + klen, &b->core, sizeof(bam1_core_t));
+  memcpy(p + klen + sizeof(bam1_core_t), b->data, b->l_data);
+  m_entries.push_back(e);
+  ++m_added;
+}
+
+void BXSorter::sortBuffer() {
+  const char* a = m_arena.data();
+  std::stable_sort(m_entries.begin(), m_entries.end(), [a](const Entry& x, const Entry& y) {
+      int c = memcmp(a + x.off, a + y.off, std::min(x.klen, y.klen));
+      return c < 0 || (c == 0 && x.klen < y.klen);
+    });
+}
+
+void BXLoadRecord(bam1_t* b, const char* p, uint32_t dlen) {
+  memcpy(&b->core, p, sizeof(bam1_core_t));
+  if (b->m_data < dlen) {
+    b->m_data = dlen;
+    b->data = (uint8_t*)realloc(b->data, dlen);
+    if (!b->data) {
+      std::cerr << "Out of memory loading buffered BAM record" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(b->data, p + sizeof(bam1_core_t), dlen);
+  b->l_data = dlen;
+}
+
+void BXSorter::spill() {
+
+  sortBuffer();
+
+  const std::string fn = m_prefix + "." + std::to_string(getpid()) + "." + 
+    std::to_string(m_runs.size()) + ".tmp";
+  BGZF* fp = bgzf_open(fn.c_str(), "w1");
+  if (!fp)
+    fail("Could not open temporary sort file: " + fn);
+  if (bxtools::threads > 1)
+    bgzf_mt(fp, bxtools::threads, 256);
+  m_runs.push_back(fn);
+
+  // each entry is stored as: key length, data length, key, core, data
+  for (const auto& e : m_entries) {
+    const uint32_t lens[2] = { e.klen, e.dlen };
+    if (bgzf_write(fp, lens, sizeof(lens)) < 0 ||
+	bgzf_write(fp, &m_arena[e.off], e.klen + sizeof(bam1_core_t) + e.dlen) < 0)
+      fail("Failed writing temporary sort file: " + fn);
+  }
+  if (bgzf_close(fp) < 0)
+    fail("Failed closing temporary sort file: " + fn);
+
+  m_entries.clear();
+  m_arena.clear();
+}
+
+namespace {
+
+  // one sorted run being read back during the merge
+  struct BXRun {
+    BGZF* fp = nullptr;
+    std::string key;
+    bam1_t* b = nullptr;
+    size_t idx = 0;
+    std::vector<char> buf;
+
+    // 1 for a record, 0 at the end of the run, -1 if it is truncated
+    int next() {
+      uint32_t lens[2];
+      ssize_t n = bgzf_read(fp, lens, sizeof(lens));
+      if (n == 0)
+	return 0;
+      if (n != sizeof(lens))
+	return -1;
+      const size_t len = lens[0] + sizeof(bam1_core_t) + lens[1];
+      buf.resize(len);
+      if (bgzf_read(fp, buf.data(), len) != (ssize_t)len)
+	return -1;
+      key.assign(buf.data(), lens[0]);
+      BXLoadRecord(b, buf.data() + lens[0], lens[1]);
+      return 1;
+    }
+  };
+
+  // min-heap on key, ties broken by run order to keep the sort stable
+  struct BXRunCompare {
+    bool operator()(const BXRun* x, const BXRun* y) const {
+      int c = x->key.compare(y->key);
+      return c > 0 || (c == 0 && x->idx > y->idx);
+    }
+  };
+}
+
+void BXSorter::Merge(const Visitor& f) {
+
+  bam1_t* b = bam_init1();
+  std::string key;
+
+  // everything fit in memory, no need to touch the disk
+  if (m_runs.empty()) {
+    sortBuffer();
+    for (const auto& e : m_entries) {
+      const char* p = &m_arena[e.off];
+      key.assign(p, e.klen);
+      BXLoadRecord(b, p + e.klen, e.dlen);
+      f(key, b);
+    }
+    m_entries.clear();
+    m_arena.clear();
+    bam_destroy1(b);
+    return;
+  }
+
+  if (m_entries.size())
+    spill();
+  std::vector<char>().swap(m_arena); // give the buffer back for the merge
+  bam_destroy1(b);
+
+  std::vector<BXRun> runs(m_runs.size());
+  std::priority_queue<BXRun*, std::vector<BXRun*>, BXRunCompare> heap;
+  for (size_t i = 0; i < runs.size(); ++i) {
+    runs[i].fp = bgzf_open(m_runs[i].c_str(), "r");
+    if (!runs[i].fp)
+      fail("Could not open temporary sort file: " + m_runs[i]);
+    runs[i].b = bam_init1();
+    runs[i].idx = i;
+    const int n = runs[i].next();
+    if (n < 0)
+      fail("Truncated temporary sort file: " + m_runs[i]);
+    if (n)
+      heap.push(&runs[i]);
+  }
+
+  while (!heap.empty()) {
+    BXRun* r = heap.top();
+    heap.pop();
+    f(r->key, r->b);
+    const int n = r->next();
+    if (n < 0)
+      fail("Truncated temporary sort file: " + m_runs[r->idx]);
+    if (n)
+      heap.push(r);
+  }
+
+  for (auto& r : runs) {
+    bgzf_close(r.fp);
+    bam_destroy1(r.b);
+  }
+  
+}
@@ -0,0 +1,68 @@
+#ifndef BXTOOLS_BXSORT_H__
+#define BXTOOLS_BXSORT_H__
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+#include "htslib/sam.h"
+
+// load a record stored as core then data into a bam1_t, growing its data
+// block as needed
+void BXLoadRecord(bam1_t* b, const char* p, uint32_t dlen);
+
+// External sort of BAM records by a string key (e.g. the BX tag). Records
+// are buffered in memory up to a byte budget, then sorted and spilled to a
+// temporary BGZF run on disk. Merge() does a k-way merge of the runs (and
+// whatever is still in memory) and hands each record back in key order.
+// Records with equal keys come back in the order they were added. The
+// buffer grows up to the budget as it is needed, and the runs are removed
+// when the sorter is destroyed or exits on an error.
+class BXSorter {
+
+ public:
+
+  // called for each record during the merge. The record is only valid
+  // for the duration of the call
+  typedef std::function<void(const std::string& key, bam1_t* b)> Visitor;
+
+  BXSorter(size_t max_mem, const std::string& prefix);
+
+  ~BXSorter();
+
+  void Add(const char* key, size_t klen, const bam1_t* b);
+
+  void Add(const std::string& key, const bam1_t* b) { Add(key.data(), key.size(), b); }
+
+  void Merge(const Visitor& f);
+
+  size_t NumRuns() const { return m_runs.size(); }
+
+  size_t NumRecords() const { return m_added; }
+  
+ private:
+
+  struct Entry {
+    uint64_t off;  // offset into the arena
+    uint32_t klen; // key length. Record follows the key
+    uint32_t dlen; // length of bam1_t data
+  };
+
+  size_t m_max;
+  std::string m_prefix;
+  std::vector<char> m_arena;
+  std::vector<Entry> m_entries;
+  std::vector<std::string> m_runs;
+  size_t m_added = 0;
+
+  void sortBuffer();
+  void spill();
+  void removeRuns();
+
+  // report an error and exit, removing the runs on disk first
+  void fail(const std::string& msg);
+  
+};
+
+#endif
@@ -1,20 +1,31 @@
 #include "bxsplit.h"
 
 #include "bxcommon.h"
+#include "bxprof.h"
 #include <string>
 #include <getopt.h>
 #include <iostream>
 #include <sstream>
+#include <list>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "htslib/sam.h"
+#include "htslib/bgzf.h"
 
 #include "SeqLib/BamReader.h"
 #include "SeqLib/BamWriter.h"
 
-struct BXTag {
-
-  SeqLib::BamWriter w;
-  size_t count = 0;
-  SeqLib::BamRecordVector buff;
-};
+#include "bxaux.h"
+#include "bxdict.h"
+#include "bxfilter.h"
+#include "bxpending.h"
+#include "bxsort.h"
+#include "bxindex.h"
 
 namespace opt {
 
@@ -25,9 +36,140 @@ namespace opt {
   static int min = 0; // minimum number of reads before writing
   static std::string tag = "BX"; // tag to split by
   static bool include_empty = false; // output BAM with empty reads
+  static size_t max_open = 1000; // max number of output BAMs open at once
+  static std::string whitelist; // only split barcodes on this list
+  static size_t sketch_mb = 256; // size of the --min-reads prefilter sketch
+  static size_t max_mem = 2000; // MB of reads held back by --min-reads and sorted for -o, before spilling
+  static std::string output; // one BAM grouped by barcode, rather than one per barcode
+}
+
+struct BXTag {
+
+  size_t count = 0;
+  BXPending::List pending; // reads held back until min is reached
+  int slot = -1;    // index of the open writer in the pool, -1 if closed
+  bool started = false; // output BAM created, so reopen it to append
+};
+
+// the empty block bgzf_close ends a file with
+static const unsigned char BGZF_EOF[28] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C',
+					    2, 0, 0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+// cut the EOF block off the end of a BGZF file, so more blocks can be
+// appended and readers don't take the old end for the end of the file
+static bool dropEOF(const std::string& fn) {
+  int fd = open(fn.c_str(), O_RDWR);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  unsigned char tail[sizeof(BGZF_EOF)];
+  bool ok = fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(tail) &&
+    pread(fd, tail, sizeof(tail), st.st_size - sizeof(tail)) == (ssize_t)sizeof(tail) &&
+    !memcmp(tail, BGZF_EOF, sizeof(tail)) && ftruncate(fd, st.st_size - sizeof(tail)) == 0;
+  return ::close(fd) == 0 && ok;
 }
 
-static const char* shortopts = "hvxeb:a:m:t:";
+// Keeps at most max_open BAM writers open at once. When a tag needs a writer
+// and the pool is full, the least recently used writer is closed. A tag's
+// BAM gets its header once, and when the tag comes back it is reopened in
+// BGZF append mode, less its EOF block. So there is one file per tag however
+// often it is evicted, and nothing to merge at the end. The per tag writers
+// compress on the calling thread, as a thread pool per file would not pay
+class BXWriterPool {
+
+public:
+
+  BXWriterPool(size_t max_open, const SeqLib::BamHeader& h, const BXDict& d) 
+    : m_max(std::max(max_open, (size_t)1)), m_hdr(h), m_dict(d) {}
+
+  bool Write(BXID bx, BXTag& t, const SeqLib::BamRecord& r) {
+    return Write(bx, t, r.raw());
+  }
+
+  bool Write(BXID bx, BXTag& t, const bam1_t* b) {
+    bxtools::Profile().Wrote(sizeof(bam1_core_t) + b->l_data);
+    if (t.slot < 0)
+      open(bx, t);
+    else if (m_lru.front() != (size_t)t.slot) 
+      m_lru.splice(m_lru.begin(), m_lru, m_slots[t.slot].lru);
+    return bam_write1(m_slots[t.slot].fp, b) >= 0;
+  }
+
+  // close all of the writers
+  void Finish() {
+    for (auto& s : m_slots) {
+      close(s);
+      s.tag->slot = -1;
+    }
+    m_slots.clear();
+    m_lru.clear();
+  }
+  
+private:
+
+  struct Slot {
+    BGZF* fp = nullptr;
+    BXID bx = 0;
+    BXTag* tag = nullptr;
+    std::list<size_t>::iterator lru;
+  };
+
+  size_t m_max;
+  SeqLib::BamHeader m_hdr;
+  const BXDict& m_dict;
+  std::vector<Slot> m_slots;
+  std::list<size_t> m_lru; // slot indices, most recently used at front
+
+  std::string bamName(BXID bx) const {
+    std::string bname = opt::analysis_id + ".";
+    m_dict.Decode(bx, bname);
+    bname += ".bam";
+    return bname;
+  }
+
+  void close(Slot& s) {
+    if (s.fp && bgzf_close(s.fp) < 0) {
+      std::cerr << "Failed closing BAM: " << bamName(s.bx) << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    s.fp = nullptr;
+  }
+  
+  void open(BXID bx, BXTag& t) {
+
+    size_t i;
+    if (m_slots.size() < m_max) {
+      i = m_slots.size();
+      m_slots.push_back(Slot());
+      m_lru.push_front(i);
+    } else {
+      // evict the least recently used writer
+      i = m_lru.back();
+      close(m_slots[i]);
+      m_slots[i].tag->slot = -1;
+      m_lru.splice(m_lru.begin(), m_lru, std::prev(m_lru.end()));
+    }
+    m_slots[i].lru = m_lru.begin();
+    m_slots[i].tag = &t;
+    m_slots[i].bx = bx;
+    t.slot = i;
+
+    const std::string bname = bamName(bx);
+    BGZF* fp = t.started && !dropEOF(bname) ? nullptr : bgzf_open(bname.c_str(), t.started ? "a" : "w");
+    if (!fp || (!t.started && bam_hdr_write(fp, m_hdr.get_()) < 0)) {
+      std::cerr << "Could not open BAM: " << bname << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (!t.started)
+      std::cerr << "creating new output BAM: " << bname << std::endl;
+    t.started = true;
+    m_slots[i].fp = fp;
+  }
+  
+};
+
+
+static const char* shortopts = "hvxeb:a:m:t:f:W:M:o:";
 static const struct option longopts[] = {
   { "help",                    no_argument, NULL, 'h' },
   { "no-output",               no_argument, NULL, 'x' },
@@ -36,6 +178,11 @@ static const struct option longopts[] = {
   { "include-empty",           no_argument, NULL, 'e' },
   { "min-reads",               required_argument, NULL, 'm' },
   { "tag",                     required_argument, NULL, 't' },
+  { "max-open",                required_argument, NULL, 'f' },
+  { "whitelist",               required_argument, NULL, 'W' },
+  { "sketch-mb",               required_argument, NULL, 'K' },
+  { "max-mem",                 required_argument, NULL, 'M' },
+  { "output",                  required_argument, NULL, 'o' },
   { NULL, 0, NULL, 0 }
 };
 
@@ -51,6 +198,14 @@ static const char *SPLIT_USAGE_MESSAGE =
 "  -m, --min-reads                      Minumum reads of given tag to see before writing [0]\n"
 "  -t, --tag                            Split by a tag other than BX (e.g. MI)\n"
 "  -e, --include-empty                  Output a BAM with all of the reads with empty tag\n"
+"  -f, --max-open                       Max number of output BAMs to hold open at once [1000]\n"
+"  -W, --whitelist                      Only split barcodes listed in this file (one per line, -N suffix ignored)\n"
+"      --sketch-mb                      Memory for the -m prefilter that drops rare barcodes up front [256]\n"
+"  -M, --max-mem                        MB of reads to hold in memory for barcodes under -m, before\n"
+"                                       spilling them to <id>.pending.*.tmp files. Also the sort buffer for -o.\n"
+"                                       With both -m and -o, each gets half [2000]\n"
+"  -o, --output                         Write one BAM with the reads grouped by barcode, and an offset table\n"
+"                                       (<output>.bxo) for bxtools fetch, instead of one BAM per barcode\n"
 "\n";
 
 void parseSplitOptions(int argc, char** argv) {
@@ -74,6 +229,11 @@ void parseSplitOptions(int argc, char** argv) {
     case 'e': opt::include_empty = true; break;
     case 'm': arg >> opt::min; break;
     case 't': arg >> opt::tag; break;
+    case 'f': arg >> opt::max_open; break;
+    case 'W': arg >> opt::whitelist; break;
+    case 'K': arg >> opt::sketch_mb; break;
+    case 'M': arg >> opt::max_mem; break;
+    case 'o': arg >> opt::output; break;
     }
   }
 
@@ -83,6 +243,58 @@ void parseSplitOptions(int argc, char** argv) {
   }
 }
 
+// Write the reads from the sorter to one BAM, and the offset of each barcode
+// to <output>.bxo. The BAM is compressed on one thread, so that bgzf_tell
+// gives the offsets. Grouped by barcode, it is no longer in coordinate order
+static void writeGrouped(BXSorter& sorter, const SeqLib::BamHeader& in) {
+
+  BXPhaseTimer write_time(BXPHASE_WRITE);
+  const SeqLib::BamHeader hdr(bxtools::UnsortedHeader(in.AsString()));
+
+  htsFile* out = sam_open(opt::output.c_str(), "wb");
+  if (!out || sam_hdr_write(out, hdr.get_()) < 0) {
+    std::cerr << "Could not open BAM: " << opt::output << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  std::vector<BXOffsetEntry> entries;
+  std::string names;
+  std::string last;
+  sorter.Merge([&](const std::string& key, bam1_t* b) {
+      if (entries.empty() || key != last) {
+	const int64_t voff = bgzf_tell(out->fp.bgzf);
+	if (!entries.empty())
+	  entries.back().end = voff;
+	BXOffsetEntry e;
+	e.name = names.size();
+	e.begin = e.end = voff;
+	e.n = 0;
+	entries.push_back(e);
+	names.append(key.c_str(), key.size() + 1);
+	last = key;
+      }
+      if (sam_write1(out, hdr.get_(), b) < 0) {
+	std::cerr << "Failed writing BAM: " << opt::output << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      ++entries.back().n;
+      bxtools::Profile().Wrote(sizeof(bam1_core_t) + b->l_data);
+    });
+  if (!entries.empty())
+    entries.back().end = bgzf_tell(out->fp.bgzf);
+  if (sam_close(out) < 0) {
+    std::cerr << "Failed closing BAM: " << opt::output << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  const std::string fn = opt::output + ".bxo";
+  if (!BXOffsets::Write(fn, entries, names)) {
+    std::cerr << "Failed writing offset table " << fn << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::cerr << "...wrote " << entries.size() << " barcodes to " << opt::output << std::endl;
+}
+
 void runSplit(int argc, char** argv) {
   
   parseSplitOptions(argc, argv);
@@ -93,69 +305,106 @@ void runSplit(int argc, char** argv) {
     std::cerr << "Failed to open bam: " << opt::bam << std::endl;
     exit(EXIT_FAILURE);
   }
+  BXTHREADS(reader)
+
+  // barcodes to drop before they get a map entry
+  BXFilter filter;
+  filter.Init(opt::whitelist, opt::min, opt::sketch_mb, opt::bam, opt::tag);
   
-  // make a collection of writers
-  std::unordered_map<std::string, BXTag> tags;
+  // make a collection of tags, and a bounded pool of writers
+  BXDict dict(bxtools::GetDict());
+  std::unordered_map<BXID, BXTag, BXHash> tags;
+  BXWriterPool pool(opt::max_open, reader.Header(), dict);
+  const BXID empty_id = dict.Encode("bxe"); // bxtools empty
+
+  // -M is shared between the reads held back under -m and the -o sort
+  const bool holding = opt::min > 1; // a first read already meets -m 1
+  const size_t budget = (opt::max_mem << 20) / (holding && !opt::output.empty() ? 2 : 1);
+  std::unique_ptr<BXPending> pending;
+  if (holding)
+    pending.reset(new BXPending(budget, opt::analysis_id + ".pending"));
+
+  // with -o, everything goes through an external sort on the barcode instead
+  std::unique_ptr<BXSorter> sorter;
+  if (!opt::output.empty())
+    sorter.reset(new BXSorter(budget, opt::analysis_id + ".sort"));
 
   // loop and write
   SeqLib::BamRecord r;
   size_t count = 0;
   bool hit = false;
-  while (reader.GetNextRecord(r)) {
+  BXAux aux(opt::tag.c_str());
+  BXStrRef bxs; // points into r
+  while (BXNextRecord(reader, r)) {
 
     ++count;
 
     // sanity check
     BXLOOPCHECK(r, hit, opt::tag)
 
-    std::string bx;
-    r.GetTag(opt::tag, bx);
-    if (bx.empty()) {
+    BXPhaseTimer tag_time(BXPHASE_TAG);
+    if (!aux.Scan(r.raw()) || !aux.Text(0, bxs))
+      bxs = BXStrRef();
+    tag_time.Stop();
+
+    BXPhaseTimer map_time(BXPHASE_MAP);
+    BXID bx = empty_id;
+    if (bxs.empty()) {
       if (!opt::include_empty)
 	continue;
-      bx="bxe"; // bxtools empty
+      bxs = BXStrRef("bxe");
     } else {
       hit = true;
+      if (!filter.Pass(bxs.data, bxs.size))
+	continue;
+      bx = dict.Encode(bxs.data, bxs.size);
     }
     
-    ++tags[bx].count;
+    BXTag& t = tags[bx];
+    ++t.count;
+    map_time.Stop();
 
     if (opt::noop)
       continue;
     
-    if (tags[bx].count < opt::min) {
-      tags[bx].buff.push_back(r);
+    BXPhaseTimer write_time(BXPHASE_WRITE);
+    if (t.count < opt::min) {
+      pending->Add(t.pending, r.raw());
       continue;
     }
     
-    // have a buffer to clear or hit first read with no min
-    if (tags[bx].buff.size() || (opt::min <= 0 && tags[bx].count == 1)) {   
-
-      // need to establish a new writer?
-      std::string bname = opt::analysis_id + "." + bx + ".bam";
-      if (!tags[bx].w.Open(bname)) {
-	std::cerr << "Could not open BAM: " << bname << std::endl;
-	exit(EXIT_FAILURE);
-      }
-      
-      std::cerr << "creating new output BAM: " << bname << std::endl;
-      tags[bx].w.SetHeader(reader.Header());
-      tags[bx].w.WriteHeader();
-      for (const auto& rr : tags[bx].buff)
-	tags[bx].w.WriteRecord(rr);
-      tags[bx].buff.clear();
-      continue;
+    // have held back reads to write
+    if (!t.pending.empty()) {
+      pending->Replay(t.pending, [&](bam1_t* b) {
+	  if (sorter) {
+	    sorter->Add(bxs.data, bxs.size, b);
+	    return;
+	  }
+	  if (!pool.Write(bx, t, b)) {
+	    std::cerr << "failed to write read " << bam_get_qname(b) << " to BAM for " << bxs << std::endl;
+	    exit(EXIT_FAILURE);
+	  }
+	});
     }
     
-    if (!tags[bx].w.WriteRecord(r)) {
-      std::cerr << "failed to write read " << r << " to BAM for " << bx << std::endl;
+    if (sorter)
+      sorter->Add(bxs.data, bxs.size, r.raw());
+    else if (!pool.Write(bx, t, r)) {
+      std::cerr << "failed to write read " << r << " to BAM for " << bxs << std::endl;
       exit(EXIT_FAILURE);
     }
     
   }
 
+  if (sorter)
+    writeGrouped(*sorter, reader.Header());
+  pool.Finish();
+  bxtools::Profile().Map("split.tags", tags);
+  if (opt::verbose && pending && pending->NumSpills())
+    std::cerr << "...spilled reads under -m to disk " << pending->NumSpills() << " times" << std::endl;
+
   // print the final counts to std::out
   for (const auto& b : tags)
-    std::cout << b.first << "\t" << b.second.count << std::endl;
+    std::cout << dict.Decode(b.first) << "\t" << b.second.count << std::endl;
   
 }
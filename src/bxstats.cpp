@@ -1,25 +1,49 @@
 #include "bxstats.h"
 
 #include "bxcommon.h"
+#include "bxprof.h"
 
 #include <getopt.h>
 #include <iostream>
 #include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
 
 #include "SeqLib/BamReader.h"
 
+#include "bxaux.h"
+#include "bxdict.h"
+#include "bxfilter.h"
+
 namespace opt {
 
   static std::string bam; // the bam to analyze
   static bool verbose = false; 
   static std::string tag = "BX"; // tag to split by
+  static bool sketch = false; // use bounded memory accumulators
+  static int sketch_k = 64; // accuracy of the quantile sketches
+  static bool percentiles = false; // also output p10 and p90
+  static int min = 0; // only output barcodes with at least this many reads
+  static std::string whitelist; // only collect barcodes on this list
+  static size_t sketch_mb = 256; // size of the --min-reads prefilter sketch
+  static std::string sort_by; // order of the output: bx, count, or as found
 }
 
-static const char* shortopts = "hvt:";
+static const char* shortopts = "hvspt:k:m:W:S:";
 static const struct option longopts[] = {
   { "help",                    no_argument, NULL, 'h' },
   { "tag",                     required_argument, NULL, 't' },
   { "bam",                     required_argument, NULL, 'b' },
+  { "sketch",                  no_argument, NULL, 's' },
+  { "sketch-k",                required_argument, NULL, 'k' },
+  { "percentiles",             no_argument, NULL, 'p' },
+  { "min-reads",               required_argument, NULL, 'm' },
+  { "whitelist",               required_argument, NULL, 'W' },
+  { "sketch-mb",               required_argument, NULL, 'K' },
+  { "sort",                    required_argument, NULL, 'S' },
   { NULL, 0, NULL, 0 }
 };
 
@@ -30,10 +54,185 @@ static const char *STAT_USAGE_MESSAGE =
 "  General options\n"
 "  -v, --verbose                        Set verbose output\n"
 "  -t, --tag                            Collect stats by a tag other than BX (e.g. MI)\n"
+"  -s, --sketch                         Bounded memory per BX: exact MAPQ histogram and quantile sketches\n"
+"                                       for insert size and AS, instead of storing every value\n"
+"  -k, --sketch-k                       Size of the quantile sketches with -s. Larger is more accurate, at most 65535 [64]\n"
+"  -p, --percentiles                    Also output the 10th and 90th percentile of each value\n"
+"  -m, --min-reads                      Only output barcodes with at least this many reads [0]\n"
+"  -W, --whitelist                      Only collect barcodes listed in this file (one per line, -N suffix ignored)\n"
+"      --sketch-mb                      Memory for the -m prefilter that drops rare barcodes up front [256]\n"
+"  -S, --sort                           Sort the output by barcode (bx) or by read count, most first (count)\n"
 "\n";
 
 static void parseOptions(int argc, char** argv);
 
+typedef std::unordered_map<BXID, BXStat, BXHash> BXStatMap;
+
+// add a read to the stats of its barcode. aux has been scanned for the read,
+// with the barcode tag in slot 0 and AS in slot 1
+static void addRead(BXStat& b, const SeqLib::BamRecord& r, const BXAux& aux);
+
+// one line per barcode with enough reads, summarized on threads
+static void writeStats(std::ostream& os, const BXDict& dict, const std::vector<BXStatMap*>& maps);
+
+class BXStatVisitor : public BXVisitor {
+
+public:
+
+  BXStatVisitor(std::ostream& os) : m_os(os), m_dict(bxtools::GetDict()), m_aux(opt::tag.c_str(), "AS") {
+    m_filter.Init(opt::whitelist, opt::min, opt::sketch_mb, opt::bam, opt::tag);
+  }
+
+  void Visit(const SeqLib::BamRecord& r) {
+
+    BXPhaseTimer tag_time(BXPHASE_TAG);
+    m_aux.Scan(r.raw());
+    BXStrRef bx;
+    if (!m_aux.Text(0, bx) || !m_filter.Pass(bx.data, bx.size))
+      return;
+    tag_time.Stop();
+
+    BXPhaseTimer map_time(BXPHASE_MAP);
+    addRead(m_stats[m_dict.Encode(bx.data, bx.size)], r, m_aux);
+  }
+
+  void Finish() {
+    bxtools::Profile().Map("stats.barcodes", m_stats);
+    writeStats(m_os, m_dict, std::vector<BXStatMap*>(1, &m_stats));
+  }
+
+  size_t size() const { return m_stats.size(); }
+  
+private:
+
+  std::ostream& m_os;
+  BXDict m_dict;
+  BXFilter m_filter;
+  BXStatMap m_stats;
+  BXAux m_aux;
+  
+};
+
+BXVisitor* NewStatVisitor(int argc, char** argv, std::ostream& os) {
+  parseOptions(argc, argv);
+  return new BXStatVisitor(os);
+}
+
+// Stats on nthreads workers. The reader fills batches of reads and hands
+// each to whichever worker is free. A worker keeps its stats split into one
+// shard per worker by barcode hash, so no map is ever shared. Once the input
+// is read, worker s merges shard s of every worker into its own, all at once
+static void runStatParallel(SeqLib::BamReader& reader, int nthreads) {
+
+  BXFilter filter;
+  filter.Init(opt::whitelist, opt::min, opt::sketch_mb, opt::bam, opt::tag);
+  BXDict dict(bxtools::GetDict()); // shared, only interned barcodes take its lock
+
+  const size_t BATCH = 4096;
+  const size_t NBATCH = 4 * nthreads;
+  std::vector<SeqLib::BamRecordVector> batches(NBATCH, SeqLib::BamRecordVector(BATCH));
+  std::vector<size_t> sizes(NBATCH, 0);
+  std::deque<size_t> full, spare;
+  for (size_t i = 0; i < NBATCH; ++i)
+    spare.push_back(i);
+  bool eof = false;
+  std::mutex mtx;
+  std::condition_variable cv_full, cv_spare;
+
+  // shards[w][s] is worker w's stats for the barcodes of shard s
+  std::vector<std::vector<BXStatMap> > shards(nthreads, std::vector<BXStatMap>(nthreads));
+  std::atomic<size_t> found(0);
+
+  auto worker = [&](int w) {
+    BXAux aux(opt::tag.c_str(), "AS");
+    BXHash hash;
+    std::vector<BXStatMap>& mine = shards[w];
+    for (;;) {
+      size_t slot;
+      {
+	std::unique_lock<std::mutex> lock(mtx);
+	cv_full.wait(lock, [&]() { return !full.empty() || eof; });
+	if (full.empty())
+	  break;
+	slot = full.front();
+	full.pop_front();
+      }
+
+      BXPhaseTimer map_time(BXPHASE_MAP);
+      size_t n = 0;
+      for (size_t i = 0; i < sizes[slot]; ++i) {
+	const SeqLib::BamRecord& r = batches[slot][i];
+	BXStrRef bx;
+	if (!aux.Scan(r.raw()) || !aux.Text(0, bx) || !filter.Pass(bx.data, bx.size))
+	  continue;
+	const BXID id = dict.Encode(bx.data, bx.size);
+	addRead(mine[hash(id) % nthreads][id], r, aux);
+	++n;
+      }
+      map_time.Stop();
+      found += n;
+
+      std::lock_guard<std::mutex> lock(mtx);
+      spare.push_back(slot);
+      cv_spare.notify_one();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nthreads; ++i)
+    threads.push_back(std::thread(worker, i));
+
+  size_t count = 0;
+  while (!eof) {
+    size_t slot;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv_spare.wait(lock, [&]() { return !spare.empty(); });
+      slot = spare.front();
+      spare.pop_front();
+    }
+    SeqLib::BamRecordVector& b = batches[slot];
+    size_t n = 0;
+    while (n < BATCH && BXNextRecord(reader, b[n])) {
+      BXLOOPCHECK(b[n], found.load(std::memory_order_relaxed), opt::tag)
+      ++n;
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    sizes[slot] = n;
+    full.push_back(slot);
+    eof = n < BATCH;
+    if (eof)
+      cv_full.notify_all();
+    else
+      cv_full.notify_one();
+  }
+  for (auto& t : threads)
+    t.join();
+  threads.clear();
+
+  for (int s = 0; s < nthreads; ++s)
+    threads.push_back(std::thread([&shards, s, nthreads]() {
+	  BXStatMap& into = shards[s][s];
+	  for (int w = 0; w < nthreads; ++w) {
+	    if (w == s)
+	      continue;
+	    for (auto& b : shards[w][s])
+	      into[b.first].Merge(b.second);
+	    BXStatMap().swap(shards[w][s]);
+	  }
+	}));
+  for (auto& t : threads)
+    t.join();
+
+  std::vector<BXStatMap*> merged;
+  for (int s = 0; s < nthreads; ++s) {
+    bxtools::Profile().Map("stats.shard" + std::to_string(s), shards[s][s]);
+    merged.push_back(&shards[s][s]);
+  }
+  writeStats(std::cout, dict, merged);
+}
+
 void runStat(int argc, char** argv) {
   
   parseOptions(argc, argv);
@@ -44,49 +243,137 @@ void runStat(int argc, char** argv) {
     std::cerr << "Failed to open bam: " << opt::bam << std::endl;
     exit(EXIT_FAILURE);
   }
+  BXTHREADS(reader)
+
+  if (bxtools::threads > 1) {
+    runStatParallel(reader, bxtools::threads);
+    return;
+  }
 
-  std::unordered_map<std::string, BXStat> bxstats;
+  BXStatVisitor stats(std::cout);
 
   // loop and collect
   SeqLib::BamRecord r;
   size_t count = 0;
-  while (reader.GetNextRecord(r)) {
-    std::string bx;
-    bool tag_present = r.GetTag(opt::tag, bx);
-
-    BXLOOPCHECK(r, bxstats.size(), opt::tag)
-
-    if (!tag_present)
-      continue;
-
-    ++bxstats[bx].count;
-    bxstats[bx].bx = bx;
-    if (r.PairMappedFlag() && !r.Interchromosomal())
-      bxstats[bx].isize.push_back(std::abs(r.InsertSize()));
-    if (r.MappedFlag())
-      bxstats[bx].mapq.push_back(std::abs(r.MapQuality()));
-
-    int as_int = -1;
-    float as_float = -1;
-    std::string as_string = "NA";
-    if (r.GetIntTag("AS", as_int)) {
-      bxstats[bx].as.push_back(as_int);
-    } else if (r.GetFloatTag("AS", as_float)) {
-      const std::string tt = "AS";
-      bxstats[bx].as.push_back(as_float);
-    } else if (r.GetZTag("AS", as_string)) {
-      try {
-	bxstats[bx].as.push_back(std::stof(as_string));
-      } catch (...) {
-	std::cerr << "Could not convert AS:Z val of " << as_string << " to float" << std::endl;
-      }
+  while (BXNextRecord(reader, r)) {
+    BXLOOPCHECK(r, stats.size(), opt::tag)
+    stats.Visit(r);
+  }
+
+  stats.Finish();
+}
+
+// The summaries are made on bxtools::threads threads, each taking a range of
+// buckets of one map at a time and formatting its lines into its own buffer.
+// Unsorted, a buffer is written out whenever it fills. Sorted, every line is
+// held until the end, then the lines are sorted in place and written in order
+static void writeStats(std::ostream& os, const BXDict& dict, const std::vector<BXStatMap*>& maps) {
+
+  const size_t FLUSH = 1 << 20;
+  const int nthreads = std::max(1, bxtools::threads);
+  const bool sorted = !opt::sort_by.empty();
+
+  struct Part {
+    BXStatMap* m;
+    size_t first; // bucket range
+    size_t last;
+  };
+  std::vector<Part> parts;
+  for (auto m : maps) {
+    const size_t nb = m->bucket_count();
+    const size_t per = std::max((size_t)1, nb / (4 * nthreads));
+    for (size_t i = 0; i < nb; i += per) {
+      Part p = { m, i, std::min(nb, i + per) };
+      parts.push_back(p);
+    }
+  }
+
+  // a line of sorted output, in the text of one thread
+  struct Line {
+    uint32_t buf;
+    uint32_t bxlen;
+    size_t off;
+    size_t len;
+    size_t count;
+  };
+  std::vector<std::string> text(nthreads);
+  std::vector<std::vector<Line> > lines(nthreads);
+  std::atomic<size_t> next(0);
+  std::mutex mtx;
+
+  auto worker = [&](int t) {
+    std::string& out = text[t];
+    if (!sorted)
+      out.reserve(FLUSH + 4096);
+    for (size_t p = next++; p < parts.size(); p = next++)
+      for (size_t k = parts[p].first; k < parts[p].last; ++k)
+	for (auto b = parts[p].m->begin(k); b != parts[p].m->end(k); ++b) {
+	  if (b->second.count < (size_t)opt::min) // the prefilter can over count
+	    continue;
+	  Line l;
+	  l.buf = t;
+	  l.off = out.size();
+	  l.count = b->second.count;
+	  dict.Decode(b->first, out);
+	  l.bxlen = out.size() - l.off;
+	  out.push_back('\t');
+	  b->second.Format(out);
+	  out.push_back('\n');
+	  l.len = out.size() - l.off;
+	  if (sorted) {
+	    lines[t].push_back(l);
+	  } else if (out.size() >= FLUSH) {
+	    std::lock_guard<std::mutex> lock(mtx);
+	    os.write(out.data(), out.size());
+	    out.clear();
+	  }
+	}
+    if (!sorted && !out.empty()) {
+      std::lock_guard<std::mutex> lock(mtx);
+      os.write(out.data(), out.size());
+      out.clear();
     }
+  };
 
+  if (nthreads == 1) {
+    worker(0);
+  } else {
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nthreads; ++i)
+      threads.push_back(std::thread(worker, i));
+    for (auto& t : threads)
+      t.join();
   }
 
-  for (const auto& b : bxstats)
-    std::cout << b.second << std::endl;
+  if (sorted) {
+    std::vector<Line> all;
+    for (auto& l : lines) {
+      all.insert(all.end(), l.begin(), l.end());
+      std::vector<Line>().swap(l);
+    }
+    auto bxless = [&](const Line& a, const Line& b) {
+      const int c = memcmp(text[a.buf].data() + a.off, text[b.buf].data() + b.off, std::min(a.bxlen, b.bxlen));
+      return c < 0 || (c == 0 && a.bxlen < b.bxlen);
+    };
+    if (opt::sort_by == "count")
+      std::sort(all.begin(), all.end(), [&](const Line& a, const Line& b) {
+	  return a.count > b.count || (a.count == b.count && bxless(a, b));
+	});
+    else
+      std::sort(all.begin(), all.end(), bxless);
 
+    std::string out;
+    out.reserve(FLUSH + 4096);
+    for (const auto& l : all) {
+      out.append(text[l.buf], l.off, l.len);
+      if (out.size() >= FLUSH) {
+	os.write(out.data(), out.size());
+	out.clear();
+      }
+    }
+    os.write(out.data(), out.size());
+  }
+  os.flush();
 }
 
 static void parseOptions(int argc, char** argv) {
@@ -105,9 +392,27 @@ static void parseOptions(int argc, char** argv) {
     case 'v': opt::verbose = true; break;
     case 't': arg >> opt::tag; break;
     case 'h': help = true; break;
+    case 's': opt::sketch = true; break;
+    case 'k': arg >> opt::sketch_k; break;
+    case 'p': opt::percentiles = true; break;
+    case 'm': arg >> opt::min; break;
+    case 'W': arg >> opt::whitelist; break;
+    case 'K': arg >> opt::sketch_mb; break;
+    case 'S': arg >> opt::sort_by; break;
     }
   }
 
+  // the sketches store k as 16 bits
+  if (opt::sketch_k < 1 || opt::sketch_k > 65535) {
+    std::cerr << "Sketch size (-k) should be between 1 and 65535: " << opt::sketch_k << std::endl;
+    die = true;
+  }
+
+  if (!opt::sort_by.empty() && opt::sort_by != "bx" && opt::sort_by != "count") {
+    std::cerr << "Sort order should be bx or count: " << opt::sort_by << std::endl;
+    die = true;
+  }
+
   if (die || help) {
     std::cerr << "\n" << STAT_USAGE_MESSAGE;
     die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);	
@@ -115,34 +420,157 @@ static void parseOptions(int argc, char** argv) {
 
 }
 
-//http://stackoverflow.com/questions/2114797/compute-median-of-values-stored-in-vector-c
+static void addRead(BXStat& b, const SeqLib::BamRecord& r, const BXAux& aux) {
+
+  ++b.count;
+  if (r.PairMappedFlag() && !r.Interchromosomal()) {
+    if (opt::sketch)
+      b.isize_sketch.Add(std::abs(r.InsertSize()), opt::sketch_k);
+    else
+      b.isize.push_back(std::abs(r.InsertSize()));
+  }
+  if (r.MappedFlag()) {
+    if (opt::sketch)
+      b.mapq_hist.Add(std::abs(r.MapQuality()));
+    else
+      b.mapq.push_back(std::abs(r.MapQuality()));
+  }
+
+  // AS is usually an integer, but some aligners write it as a float or a string
+  int64_t as_int = -1;
+  double as_double = -1;
+  BXStrRef as_string;
+  float as_float = -1;
+  bool as_present = true;
+  if (aux.Int(1, as_int)) {
+    as_float = as_int;
+  } else if (aux.Float(1, as_double)) {
+    as_float = as_double;
+  } else if (aux.Z(1, as_string)) {
+    char* end;
+    as_float = strtof(as_string.data, &end);
+    if (end == as_string.data) {
+      as_present = false;
+      std::cerr << "Could not convert AS:Z val of " << as_string << " to float" << std::endl;
+    }
+  } else {
+    as_present = false;
+  }
+
+  if (as_present) {
+    if (opt::sketch)
+      b.as_sketch.Add(as_float, opt::sketch_k);
+    else
+      b.as.push_back(as_float);
+  }
+}
+
+// move the values of from onto the end of to
 template <class T>
-static double CalcMHWScore(std::vector<T> scores) {
-  double median;
-  size_t size = scores.size();
+static void take(std::vector<T>& to, std::vector<T>& from) {
+  if (to.empty())
+    to.swap(from);
+  else
+    to.insert(to.end(), from.begin(), from.end());
+  std::vector<T>().swap(from);
+}
 
-  std::sort(scores.begin(), scores.end());
+void BXStat::Merge(BXStat& o) {
+  count += o.count;
+  if (opt::sketch) {
+    isize_sketch.Merge(o.isize_sketch, opt::sketch_k);
+    mapq_hist.Merge(o.mapq_hist);
+    as_sketch.Merge(o.as_sketch, opt::sketch_k);
+  } else {
+    take(isize, o.isize);
+    take(mapq, o.mapq);
+    take(as, o.as);
+  }
+}
 
-  if (size  % 2 == 0)
-      median = (scores[size / 2 - 1] + scores[size / 2]) / 2;
-  else 
-      median = scores[size / 2];
+// median of v, reordering it. An even count averages the middle pair in T
+template <class T>
+static double median(std::vector<T>& v) {
+  const size_t n = v.size();
+  std::nth_element(v.begin(), v.begin() + n / 2, v.end());
+  const T hi = v[n / 2];
+  if (n % 2)
+    return hi;
+  const T lo = *std::max_element(v.begin(), v.begin() + n / 2);
+  return (lo + hi) / 2;
+}
 
-  return median;
+// nearest-rank quantile of v, reordering it
+template <class T>
+static double quantile(std::vector<T>& v, double q) {
+  const size_t i = q * (v.size() - 1);
+  std::nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
 }
 
-std::ostream& operator<<(std::ostream& out, const BXStat& b) {
-  double isize_med = -1;
-  double mapq_med = -1;
-  double as_med = -1;
-  if (b.isize.size())
-    isize_med = CalcMHWScore(b.isize);
-  if (b.mapq.size())
-    mapq_med = CalcMHWScore(b.mapq);
-  if (b.as.size())
-    as_med = CalcMHWScore(b.as);
-  out << b.bx << "\t" << b.count << "\t" << isize_med << "\t" << mapq_med 
-      << "\t" << as_med;
-  return out;
+// numbers as ostream prints them by default
+static void appendNum(std::string& out, double x) {
+  char buf[32];
+  out.append(buf, snprintf(buf, sizeof(buf), "%g", x));
 }
 
+void BXStat::Format(std::string& out) {
+  double med[3] = {-1, -1, -1};
+  double lo[3] = {-1, -1, -1};
+  double hi[3] = {-1, -1, -1};
+  if (opt::sketch) {
+    if (isize_sketch.size())
+      med[0] = isize_sketch.Median();
+    if (mapq_hist.size())
+      med[1] = mapq_hist.Median();
+    if (as_sketch.size())
+      med[2] = as_sketch.Median();
+    if (opt::percentiles) {
+      if (isize_sketch.size()) {
+	lo[0] = isize_sketch.Quantile(0.1);
+	hi[0] = isize_sketch.Quantile(0.9);
+      }
+      if (mapq_hist.size()) {
+	lo[1] = mapq_hist.Quantile(0.1);
+	hi[1] = mapq_hist.Quantile(0.9);
+      }
+      if (as_sketch.size()) {
+	lo[2] = as_sketch.Quantile(0.1);
+	hi[2] = as_sketch.Quantile(0.9);
+      }
+    }
+  } else {
+    if (isize.size())
+      med[0] = median(isize);
+    if (mapq.size())
+      med[1] = median(mapq);
+    if (as.size())
+      med[2] = median(as);
+    if (opt::percentiles) {
+      if (isize.size()) {
+	lo[0] = quantile(isize, 0.1);
+	hi[0] = quantile(isize, 0.9);
+      }
+      if (mapq.size()) {
+	lo[1] = quantile(mapq, 0.1);
+	hi[1] = quantile(mapq, 0.9);
+      }
+      if (as.size()) {
+	lo[2] = quantile(as, 0.1);
+	hi[2] = quantile(as, 0.9);
+      }
+    }
+  }
+  out += std::to_string(count);
+  for (int i = 0; i < 3; ++i) {
+    out.push_back('\t');
+    appendNum(out, med[i]);
+  }
+  if (opt::percentiles)
+    for (int i = 0; i < 3; ++i) {
+      out.push_back('\t');
+      appendNum(out, lo[i]);
+      out.push_back('\t');
+      appendNum(out, hi[i]);
+    }
+}
@@ -7,17 +7,36 @@
 #include <algorithm>
 #include <sstream>
 
+#include "SeqLib/BamHeader.h"
+
+#include "bxsketch.h"
+#include "bxvisitor.h"
+
 void runStat(int argc, char** argv);
 
+// parse stat options from argv (argv[1] is the BAM) and return the
+// per-read accumulator, writing its table to os
+BXVisitor* NewStatVisitor(int argc, char** argv, std::ostream& os);
+
 struct BXStat {
 
-  std::string bx; // label
   size_t count;   // number of reads
   std::vector<int> isize; // insert size
   std::vector<int> mapq;  // mapping quality
   std::vector<float> as;  // alignment quality
+
+  // bounded memory replacements for the vectors above (-s)
+  BXQuantileSketch<int> isize_sketch;
+  BXHistogram mapq_hist;
+  BXQuantileSketch<float> as_sketch;
   
-  friend std::ostream& operator<<(std::ostream& out, const BXStat& b);
+  // add the reads of another accumulator for the same barcode, taking
+  // its values
+  void Merge(BXStat& o);
+
+  // append the count and summary columns to out, tab separated. Reorders
+  // the values in place rather than copying them
+  void Format(std::string& out);
 
 };
 
@@ -3,11 +3,24 @@
 #include <getopt.h>
 #include <iostream>
 #include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <algorithm>
+#include <memory>
 
 #include "SeqLib/BamReader.h"
 #include "SeqLib/GenomicRegionCollection.h"
 
 #include "bxcommon.h"
+#include "bxprof.h"
+#include "bxaux.h"
+#include "bxdict.h"
+#include "bxfilter.h"
+#include "bxmatrix.h"
 
 namespace opt {
 
@@ -17,9 +30,15 @@ namespace opt {
   static int overlap = 0;
   static std::string bed; // optional bed file
   static std::string tag = "BX"; // tag to split by
+  static int chunk = 5000000; // bp per chunk when tiling in parallel
+  static std::string matrix; // binary matrix output, rather than BED
+  static bool bgzf = false; // compress the matrix
+  static int min = 0; // drop barcodes with fewer reads than this in the BAM
+  static std::string whitelist; // only count barcodes on this list
+  static size_t sketch_mb = 256; // size of the --min-reads prefilter sketch
 }
 
-static const char* shortopts = "hvw:O:b:t:";
+static const char* shortopts = "hvzw:O:b:t:c:o:m:W:";
 static const struct option longopts[] = {
   { "help",                    no_argument, NULL, 'h' },
   { "bed",                     required_argument, NULL, 'b' },
@@ -27,6 +46,12 @@ static const struct option longopts[] = {
   { "width",                   required_argument, NULL, 'w' },
   { "overlap",                 required_argument, NULL, 'O' },
   { "tag",                     required_argument, NULL, 't' },
+  { "chunk",                   required_argument, NULL, 'c' },
+  { "matrix",                  required_argument, NULL, 'o' },
+  { "bgzf",                    no_argument, NULL, 'z' },
+  { "min-reads",               required_argument, NULL, 'm' },
+  { "whitelist",               required_argument, NULL, 'W' },
+  { "sketch-mb",               required_argument, NULL, 'K' },
   { NULL, 0, NULL, 0 }
 };
 
@@ -40,8 +65,31 @@ static const char *TILE_USAGE_MESSAGE =
 "  -O, --overlap         Overlap of the tiles [0]\n"
 "  -b, --bed             Rather than tile genome, input BED with regions\n"
 "  -t, --tag             Tag other than BX to evaluate (e.g. MI)\n"
+"  -c, --chunk           With -@ > 1 and an indexed BAM, bp of tiles per parallel work unit [5,000,000]\n"
+"  -o, --matrix          Write counts as a binary sparse tile x barcode matrix to this file, instead of BED\n"
+"  -z, --bgzf            BGZF compress the -o matrix\n"
+"  -m, --min-reads       Skip barcodes with fewer reads than this in the whole BAM (approximate, at most 255, needs a file) [0]\n"
+"  -W, --whitelist       Only count barcodes listed in this file (one per line, -N suffix ignored)\n"
+"      --sketch-mb       Memory for the -m prefilter [256]\n"
 "\n";
 
+typedef std::unordered_map<BXID, size_t, BXHash> BXCounts;
+
+// append a BED line for a tile: chr, start, end, and bx_count pairs
+static void AppendTileBED(std::string& out, const std::string& chr, int32_t pos1, int32_t pos2,
+			  const BXCounts& counts, const BXDict& d) {
+  out += chr;
+  out += "\t" + std::to_string(pos1) + "\t" + std::to_string(pos2);
+  if (counts.size())
+    out += "\t";
+  for (const auto& b : counts) {
+    d.Decode(b.first, out);
+    out += "_" + std::to_string(b.second) + ",";
+  }
+  if (counts.size())
+    out.pop_back(); // erase last comma
+}
+
 class BXRegion : public SeqLib::GenomicRegion {
   
 public:
@@ -51,22 +99,399 @@ public:
   BXRegion(const std::string c, const std::string p1, const std::string p2, 
 	   const SeqLib::BamHeader& h) : GenomicRegion(c, p1, p2, h) {}
 
-  std::unordered_map<std::string, size_t> counts;
+  BXCounts counts;
+
+};
+
+// Where finished tiles go, in genome order: BED lines to a stream, or rows of
+// a tile matrix (-o). A buffer (NewBuffer) holds on to its tiles until they
+// are passed on with MoveTo, which is how parallel chunks keep their order
+class BXTileSink {
+
+public:
+
+  BXTileSink(const SeqLib::BamHeader& h, const BXDict& d, std::ostream* os, BXMatrixWriter* m)
+    : m_dict(d), m_os(os), m_matrix(m) {
+    for (const auto& s : h.GetHeaderSequenceVector())
+      m_own_names.push_back(s.Name);
+    m_names = &m_own_names;
+    if (m_matrix)
+      m_matrix->SetChromosomes(m_own_names);
+  }
+
+  BXTileSink* NewBuffer() const {
+    return new BXTileSink(*m_names, m_dict, m_matrix != nullptr);
+  }
+
+  // add the next tile. The counts may be taken
+  void Add(int32_t chr, int32_t pos1, int32_t pos2, BXCounts& counts) {
+    if (m_matrix) {
+      m_matrix->AddTile(chr, pos1, pos2, counts);
+    } else if (m_hold) {
+      m_held.push_back(BXHeldTile());
+      m_held.back().chr = chr;
+      m_held.back().pos1 = pos1;
+      m_held.back().pos2 = pos2;
+      m_held.back().counts.swap(counts);
+    } else {
+      AppendTileBED(m_text, (*m_names)[chr], pos1, pos2, counts, m_dict);
+      m_text += "\n";
+      flush(false);
+    }
+  }
+
+  // pass everything held on to s
+  void MoveTo(BXTileSink& s) {
+    for (auto& t : m_held)
+      s.Add(t.chr, t.pos1, t.pos2, t.counts);
+    m_held.clear();
+    if (m_text.size()) {
+      s.m_text += m_text;
+      m_text.clear();
+      s.flush(false);
+    }
+  }
 
-  std::string ToBEDString(const SeqLib::BamHeader& h) const {
-    std::string out = h.IDtoName(chr) + "\t" + std::to_string(pos1) + 
-      "\t" + std::to_string(pos2);
-    if (counts.size())
-      out += "\t";
-    for (const auto& b : counts)
-      out +=  b.first + "_" + std::to_string(b.second) + ",";
-    if (counts.size())
-      out.pop_back(); // erase last comma
-    return out;
+  void Flush() { 
+    flush(true); 
   }
+  
+private:
+
+  struct BXHeldTile {
+    int32_t chr, pos1, pos2;
+    BXCounts counts;
+  };
+  
+  BXTileSink(const std::vector<std::string>& names, const BXDict& d, bool hold)
+    : m_names(&names), m_dict(d), m_hold(hold) {}
+  
+  std::vector<std::string> m_own_names;
+  const std::vector<std::string>* m_names;
+  const BXDict& m_dict;
+  std::ostream* m_os = nullptr;
+  BXMatrixWriter* m_matrix = nullptr;
+  bool m_hold = false; // buffer tiles rather than text
+  std::string m_text;
+  std::vector<BXHeldTile> m_held;
+
+  void flush(bool force) {
+    if (m_os && (force || m_text.size() > (1 << 20))) {
+      m_os->write(m_text.data(), m_text.size());
+      m_text.clear();
+    }
+    if (m_os && force)
+      m_os->flush();
+  }
+  
 };
 
+// Fixed width tiles along each chromosome, laid out the same way as
+// GenomicRegionCollection(width, overlap, ...): tile k spans 
+// [k * step, k * step + width] with step = width - overlap, and the last tile
+// on a chromosome is cut short at the chromosome end
+class BXTileGrid {
+
+public:
+
+  BXTileGrid(const SeqLib::BamHeader& h, int32_t width, int32_t overlap) 
+    : m_width(width), m_step(width - overlap) {
+    if (m_step <= 0) {
+      std::cerr << "Tile width should be greater than the overlap" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    for (const auto& s : h.GetHeaderSequenceVector()) {
+      m_len.push_back(s.Length);
+      size_t n = 1;
+      if ((int32_t)s.Length >= width) {
+	n = (s.Length - width) / m_step + 1;
+	if ((int64_t)(n - 1) * m_step + width != s.Length)
+	  ++n;
+      }
+      m_num.push_back(n);
+    }
+  }
+
+  int NumChr() const { return m_len.size(); }
+
+  size_t NumTiles(int chr) const { return m_num[chr]; }
+
+  int32_t Start(size_t k) const { return k * m_step; }
+
+  int32_t End(int chr, size_t k) const { 
+    return std::min((int64_t)k * m_step + m_width, (int64_t)m_len[chr]); 
+  }
+
+  int32_t Step() const { return m_step; }
+
+  // first and last tile that could overlap [p1, p2]
+  size_t First(int32_t p1) const {
+    return p1 <= m_width ? 0 : (p1 - m_width + m_step - 1) / m_step;
+  }
+
+  size_t Last(int chr, int32_t p2) const {
+    return std::min((size_t)(std::max(p2, 0) / m_step), m_num[chr] - 1);
+  }
+  
+private:
+
+  int32_t m_width;
+  int32_t m_step;
+  std::vector<uint32_t> m_len;
+  std::vector<size_t> m_num;
+  
+};
+
+// Sweep-line tile counter for coordinate sorted input. The tiles a read hits
+// come straight from its position, only the tiles between the last one
+// written and the current read are held in memory, and each tile is written
+// as soon as the sweep moves past its end. Covers the tiles from 
+// (chr_begin, k_begin) up to but not including (chr_end, k_end), which is
+// either the whole genome or a chunk of one chromosome
+class BXTileSweep {
+
+public:
+
+  BXTileSweep(const BXTileGrid& g, BXTileSink& s, int chr_begin, size_t k_begin,
+	      int chr_end, size_t k_end) 
+    : m_grid(g), m_sink(s), m_chr(chr_begin), m_base(k_begin), 
+      m_chr_end(chr_end), m_k_end(k_end) {}
+
+  // add a read on [p1, p2]. Returns false if reads are out of order
+  bool Add(int32_t chr, int32_t p1, int32_t p2, BXID id) {
+
+    if (chr < m_chr)
+      return false;
+    advance(chr, p1);
+    if (chr != m_chr)
+      return true; // past the end of the range
+    if (p1 < m_last)
+      return false;
+    m_last = p1;
+
+    const size_t last = lastTile();
+    size_t k = std::max(m_grid.First(p1), m_base);
+    const size_t khi = std::min(m_grid.Last(chr, p2), last - 1);
+    for (; k <= khi && k < last; ++k) {
+      if (m_grid.Start(k) > p2 || m_grid.End(chr, k) < p1)
+	continue;
+      while (m_win.size() <= k - m_base)
+	m_win.push_back(BXCounts());
+      ++m_win[k - m_base][id];
+    }
+    return true;
+  }
+
+  // write out every remaining tile in the range
+  void Finish() {
+    advance(m_chr_end, 0);
+    flushChr();
+  }
+  
+private:
+
+  const BXTileGrid& m_grid;
+  BXTileSink& m_sink;
+  int m_chr;     // chromosome of the sweep
+  size_t m_base; // next tile to write on m_chr, front of m_win
+  int m_chr_end;
+  size_t m_k_end;
+  int32_t m_last = -1;
+  std::deque<BXCounts> m_win;
+
+  size_t lastTile() const {
+    return m_chr == m_chr_end ? m_k_end : m_grid.NumTiles(m_chr);
+  }
+  
+  void emit() {
+    if (m_win.empty())
+      m_win.push_back(BXCounts());
+    m_sink.Add(m_chr, m_grid.Start(m_base), m_grid.End(m_chr, m_base), m_win.front());
+    m_win.pop_front();
+    ++m_base;
+  }
+
+  // write every tile left on the current chromosome
+  void flushChr() {
+    const size_t last = lastTile();
+    while (m_base < last)
+      emit();
+    m_win.clear();
+  }
+  
+  // move the sweep up to a read starting at chr:p1
+  void advance(int chr, int32_t p1) {
+    while (m_chr < chr && m_chr < m_chr_end) {
+      flushChr();
+      ++m_chr;
+      m_base = 0;
+      m_last = -1;
+    }
+    if (m_chr != chr)
+      return;
+    const size_t last = lastTile();
+    while (m_base < last && m_grid.End(m_chr, m_base) < p1)
+      emit();
+  }
+
+};
+
+typedef SeqLib::GenomicRegionCollection<BXRegion> BXRegionCollection;
+
+// work for one chunk of the genome: fill in the tiles overlapping the reader
+// (already set to the chunk) and add them to the sink
+typedef std::function<void(size_t, SeqLib::BamReader&, BXTileSink&)> BXChunkFunc;
+
 static void parseOptions(int argc, char** argv);
+static bool runChunksParallel(const std::vector<SeqLib::GenomicRegion>& spans, const SeqLib::BamHeader& hdr,
+			      BXTileSink& sink, const BXChunkFunc& f);
+static bool runTileParallel(BXRegionCollection& tiles, const SeqLib::BamHeader& hdr, BXDict& dict,
+			    const BXFilter& filter, BXTileSink& sink);
+static bool runGridParallel(const BXTileGrid& grid, const SeqLib::BamHeader& hdr, BXDict& dict,
+			    const BXFilter& filter, BXTileSink& sink);
+
+// true if the header declares the BAM coordinate sorted
+static bool isCoordinateSorted(const SeqLib::BamHeader& hdr) {
+  std::istringstream iss(hdr.AsString());
+  std::string line;
+  while (std::getline(iss, line))
+    if (line.compare(0, 3, "@HD") == 0)
+      return line.find("SO:coordinate") != std::string::npos;
+  return false;
+}
+
+// Tile counts from reads fed one at a time: a sweep over fixed width tiles
+// for coordinate sorted input, otherwise an interval tree of all the tiles
+class BXTileVisitor : public BXVisitor {
+
+public:
+
+  BXTileVisitor(const SeqLib::BamHeader& h, std::ostream& os) 
+    : m_hdr(h), m_dict(bxtools::GetDict()), m_aux(opt::tag.c_str()) {
+    m_filter.Init(opt::whitelist, opt::min, opt::sketch_mb, opt::bam, opt::tag);
+    if (!opt::matrix.empty() && !m_matrix.Open(opt::matrix, opt::bgzf)) {
+      std::cerr << "Could not open matrix output " << opt::matrix << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    m_matrix.SetDictionary(m_dict.File());
+    m_sink.reset(new BXTileSink(h, m_dict, &os, opt::matrix.empty() ? nullptr : &m_matrix));
+    // fixed width tiles can be computed on the fly rather than stored
+    if (opt::bed.empty())
+      m_grid.reset(new BXTileGrid(h, opt::width, opt::overlap));
+  }
+
+  ~BXTileVisitor() {
+    delete m_tiles;
+  }
+  
+  // count everything through the BAM index instead, on bxtools::threads
+  // threads. Returns false if the BAM has no index
+  bool RunParallel() {
+    if (m_grid)
+      m_counted = runGridParallel(*m_grid, m_hdr, m_dict, m_filter, *m_sink);
+    else
+      m_counted = runTileParallel(tiles(), m_hdr, m_dict, m_filter, *m_sink);
+    return m_counted;
+  }
+  
+  void Visit(const SeqLib::BamRecord& r) {
+
+    BXPhaseTimer tag_time(BXPHASE_TAG);
+    BXStrRef bx;
+    if (!r.MappedFlag() || !m_aux.Scan(r.raw()) || !m_aux.Text(0, bx) || bx.empty() || !m_filter.Pass(bx.data, bx.size))
+      return;
+    tag_time.Stop();
+    ++m_found;
+    
+    if (!m_sweep && !m_tiles)
+      start();
+    BXPhaseTimer map_time(BXPHASE_MAP);
+    const BXID id = m_dict.Encode(bx.data, bx.size);
+    if (m_sweep) {
+      if (!m_sweep->Add(r.ChrID(), r.Position(), r.PositionEnd(), id)) {
+	std::cerr << "Input is not coordinate sorted at read " << r.Brief() 
+		  << ", even though the header says it is" << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      return;
+    }
+    std::vector<int> bins = m_tiles->FindOverlappedIntervals(r.AsGenomicRegion(), true);
+    for (const auto& b : bins) 
+      ++(*m_tiles)[b].counts[id];
+  }
+
+  void Finish() {
+    if (!m_counted) {
+      if (!m_sweep && !m_tiles)
+	start();
+      if (m_sweep)
+	m_sweep->Finish();
+      else
+	for (auto& b : *m_tiles)
+	  m_sink->Add(b.chr, b.pos1, b.pos2, b.counts);
+    }
+    m_sink->Flush();
+
+    if (!opt::matrix.empty()) {
+      if (!m_matrix.Close(m_dict)) {
+	std::cerr << "Failed writing matrix " << opt::matrix << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      std::cerr << "...wrote tile matrix " << opt::matrix << std::endl;
+    }
+  }
+
+  size_t Found() const { return m_found; }
+  
+private:
+
+  const SeqLib::BamHeader& m_hdr;
+  BXDict m_dict;
+  BXFilter m_filter;
+  BXMatrixWriter m_matrix;
+  std::unique_ptr<BXTileSink> m_sink;
+  std::unique_ptr<BXTileGrid> m_grid;
+  std::unique_ptr<BXTileSweep> m_sweep;
+  BXRegionCollection* m_tiles = nullptr;
+  bool m_counted = false; // done by RunParallel
+  size_t m_found = 0; // mapped reads with the tag
+  BXAux m_aux;
+
+  void start() {
+    if (m_grid && isCoordinateSorted(m_hdr)) {
+      std::cerr << "...reading sorted input, tiles with width " << SeqLib::AddCommas(opt::width) 
+		<< " and overlap " << SeqLib::AddCommas(opt::overlap) << std::endl;
+      m_sweep.reset(new BXTileSweep(*m_grid, *m_sink, 0, 0, m_grid->NumChr(), 0));
+    } else {
+      tiles();
+    }
+  }
+  
+  BXRegionCollection& tiles() {
+    if (m_tiles)
+      return *m_tiles;
+    if (!opt::bed.empty()) {
+      m_tiles = new BXRegionCollection();
+      m_tiles->ReadBED(opt::bed, m_hdr);
+      m_tiles->CreateTreeMap();
+    } else {
+      // tile it
+      std::cerr << "...creating tiles with width " << 
+	SeqLib::AddCommas(opt::width) << " and overlap " << SeqLib::AddCommas(opt::overlap) << std::endl;
+      m_tiles = new BXRegionCollection(opt::width, opt::overlap, m_hdr.GetHeaderSequenceVector());
+      std::cerr << "...created " << SeqLib::AddCommas(m_tiles->size()) << " tiles" << std::endl;
+      std::cerr << "...sorting and creating interval tree" << std::endl;
+      m_tiles->CreateTreeMap();
+    }
+    return *m_tiles;
+  }
+  
+};
+
+BXVisitor* NewTileVisitor(int argc, char** argv, const SeqLib::BamHeader& hdr, std::ostream& os) {
+  parseOptions(argc, argv);
+  return new BXTileVisitor(hdr, os);
+}
 
 void runTile(int argc, char** argv) {
   
@@ -76,47 +501,20 @@ void runTile(int argc, char** argv) {
   BXOPEN(reader, opt::bam);
   SeqLib::BamHeader hdr = reader.Header();
 
-  SeqLib::GenomicRegionCollection<BXRegion> * tiles = nullptr;
-  if (!opt::bed.empty()) {
-    tiles = new SeqLib::GenomicRegionCollection<BXRegion>();
-    tiles->ReadBED(opt::bed, hdr);
-    tiles->CreateTreeMap();
-  } else {
-    // tile it
-    std::cerr << "...creating tiles with width " << 
-      SeqLib::AddCommas(opt::width) << " and overlap " << SeqLib::AddCommas(opt::overlap) << std::endl;
-    tiles = new SeqLib::GenomicRegionCollection<BXRegion>(opt::width, opt::overlap, hdr.GetHeaderSequenceVector());
-    std::cerr << "...created " << SeqLib::AddCommas(tiles->size()) << " tiles" << std::endl;
-    std::cerr << "...sorting and creating interval tree" << std::endl;
-    tiles->CreateTreeMap();
+  BXTileVisitor tiles(hdr, std::cout);
+  if (bxtools::threads > 1 && opt::bam != "-" && tiles.RunParallel()) {
+    tiles.Finish();
+    return;
   }
 
   std::cerr << "...reading input" << std::endl;
   SeqLib::BamRecord r;
   size_t count = 0; 
-  size_t bxcount = 0;
-  while (reader.GetNextRecord(r)) {
-    std::string bx;
-    r.GetTag(opt::tag, bx);
-    BXLOOPCHECK(r, bxcount, opt::tag);
-    if (bx.empty())
-      continue;
-
-    if (r.MappedFlag()) {
-      std::vector<int> bins = tiles->FindOverlappedIntervals(r.AsGenomicRegion(), true);
-      for (const auto& b : bins) 
-	++(*tiles)[b].counts[bx];
-      ++bxcount;
-    }
-      
+  while (BXNextRecord(reader, r)) {
+    BXLOOPCHECK(r, tiles.Found(), opt::tag);
+    tiles.Visit(r);
   }
-
-  for (const auto& b : *tiles)
-    std::cout << b.ToBEDString(hdr) << std::endl;
-
-  if (tiles)
-    delete tiles;
-  
+  tiles.Finish();
 }
 
 static void parseOptions(int argc, char** argv) {
@@ -140,6 +538,12 @@ static void parseOptions(int argc, char** argv) {
     case 'O': arg >> opt::overlap; break;
     case 'b': arg >> opt::bed; break;
     case 't': arg >> opt::tag; break;
+    case 'c': arg >> opt::chunk; break;
+    case 'o': arg >> opt::matrix; break;
+    case 'z': opt::bgzf = true; break;
+    case 'm': arg >> opt::min; break;
+    case 'W': arg >> opt::whitelist; break;
+    case 'K': arg >> opt::sketch_mb; break;
     }
   }
 
@@ -150,3 +554,166 @@ static void parseOptions(int argc, char** argv) {
   
 }
 
+
+// Have worker threads pull reads for each span through the BAM index and hand
+// them to f. Spans are written out in order as they finish. Returns false
+// (having done nothing) if the BAM can't be queried by region
+static bool runChunksParallel(const std::vector<SeqLib::GenomicRegion>& spans, const SeqLib::BamHeader& hdr,
+			      BXTileSink& sink, const BXChunkFunc& f) {
+
+  if (spans.empty())
+    return false;
+
+  // make sure there is an index to seek through
+  {
+    SeqLib::BamReader reader;
+    BXOPEN(reader, opt::bam);
+    if (!reader.SetRegion(spans[0])) {
+      std::cerr << "...could not query " << opt::bam << " by region (no index?), reading it on one thread" << std::endl;
+      return false;
+    }
+  }
+
+  const int nthreads = std::min((size_t)bxtools::threads, spans.size());
+  std::cerr << "...reading input in " << SeqLib::AddCommas(spans.size()) << " chunks on " 
+	    << nthreads << " threads" << std::endl;
+
+  std::vector<BXTileSink*> out(spans.size(), nullptr);
+  std::vector<char> done(spans.size(), 0);
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::atomic<size_t> next(0);
+
+  auto worker = [&]() {
+    SeqLib::BamReader reader;
+    BXOPEN(reader, opt::bam);
+    for (size_t c = next++; c < spans.size(); c = next++) {
+      if (!reader.SetRegion(spans[c])) {
+	std::cerr << "Failed to set region " << spans[c].ToString(hdr) << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      BXTileSink* s = sink.NewBuffer();
+      f(c, reader, *s);
+      if (opt::verbose)
+	std::cerr << "...finished chunk " << spans[c].ToString(hdr) << std::endl;
+      
+      std::lock_guard<std::mutex> lock(mtx);
+      out[c] = s;
+      done[c] = 1;
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nthreads; ++i)
+    threads.push_back(std::thread(worker));
+
+  // write chunks in genome order as they become available
+  for (size_t c = 0; c < spans.size(); ++c) {
+    BXTileSink* s;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [&]() { return done[c] != 0; });
+      s = out[c];
+    }
+    s->MoveTo(sink);
+    delete s;
+  }
+
+  for (auto& t : threads)
+    t.join();
+
+  return true;
+}
+
+// a run of consecutive tiles on one chromosome, handled by one worker
+struct BXTileChunk {
+  size_t first; // index of first tile
+  size_t last;  // one past the index of the last tile
+};
+
+// Split the (sorted) tiles into chunks of about opt::chunk bp. A chunk only
+// updates its own tiles, so no locking is needed on the counts, and reads
+// that straddle two chunks are counted once per tile
+static bool runTileParallel(BXRegionCollection& tiles, const SeqLib::BamHeader& hdr, BXDict& dict,
+			    const BXFilter& filter, BXTileSink& sink) {
+
+  std::vector<BXTileChunk> chunks;
+  std::vector<SeqLib::GenomicRegion> spans;
+  for (size_t i = 0; i < tiles.size(); ++i) {
+    const BXRegion& t = tiles[i];
+    if (chunks.empty() || spans.back().chr != t.chr || 
+	t.pos1 - spans.back().pos1 >= opt::chunk) {
+      BXTileChunk c;
+      c.first = i;
+      chunks.push_back(c);
+      spans.push_back(SeqLib::GenomicRegion(t.chr, t.pos1, t.pos2));
+    }
+    chunks.back().last = i + 1;
+    spans.back().pos2 = std::max(spans.back().pos2, t.pos2);
+  }
+
+  return runChunksParallel(spans, hdr, sink, [&](size_t c, SeqLib::BamReader& reader, BXTileSink& s) {
+      const BXTileChunk& ch = chunks[c];
+      SeqLib::BamRecord r;
+      BXAux aux(opt::tag.c_str());
+      BXStrRef bx;
+      while (BXNextRecord(reader, r)) {
+	if (!r.MappedFlag() || !aux.Scan(r.raw()) || !aux.Text(0, bx) || bx.empty() || !filter.Pass(bx.data, bx.size))
+	  continue;
+	const BXID id = dict.Encode(bx.data, bx.size);
+	std::vector<int> bins = tiles.FindOverlappedIntervals(r.AsGenomicRegion(), true);
+	for (const auto& b : bins) 
+	  if ((size_t)b >= ch.first && (size_t)b < ch.last)
+	    ++tiles[b].counts[id];
+      }
+
+      // hand off, and release the counts of this chunk
+      for (size_t i = ch.first; i < ch.last; ++i) {
+	s.Add(tiles[i].chr, tiles[i].pos1, tiles[i].pos2, tiles[i].counts);
+	BXCounts().swap(tiles[i].counts);
+      }
+    });
+}
+
+// Fixed width tiles: chunks are ranges of tile indices on one chromosome, and
+// each is filled by its own sweep, so the tiles are never all in memory
+static bool runGridParallel(const BXTileGrid& grid, const SeqLib::BamHeader& hdr, BXDict& dict,
+			    const BXFilter& filter, BXTileSink& sink) {
+
+  struct GridChunk {
+    int chr;
+    size_t first;
+    size_t last;
+  };
+  
+  const size_t per = std::max(1, opt::chunk / grid.Step());
+  std::vector<GridChunk> chunks;
+  std::vector<SeqLib::GenomicRegion> spans;
+  for (int c = 0; c < grid.NumChr(); ++c)
+    for (size_t k = 0; k < grid.NumTiles(c); k += per) {
+      GridChunk g;
+      g.chr = c;
+      g.first = k;
+      g.last = std::min(k + per, grid.NumTiles(c));
+      chunks.push_back(g);
+      spans.push_back(SeqLib::GenomicRegion(c, grid.Start(g.first), grid.End(c, g.last - 1)));
+    }
+  
+  return runChunksParallel(spans, hdr, sink, [&](size_t i, SeqLib::BamReader& reader, BXTileSink& s) {
+      const GridChunk& ch = chunks[i];
+      BXTileSweep sweep(grid, s, ch.chr, ch.first, ch.chr, ch.last);
+      SeqLib::BamRecord r;
+      BXAux aux(opt::tag.c_str());
+      BXStrRef bx;
+      while (BXNextRecord(reader, r)) {
+	if (!r.MappedFlag() || !aux.Scan(r.raw()) || !aux.Text(0, bx) || bx.empty() || !filter.Pass(bx.data, bx.size))
+	  continue;
+	if (!sweep.Add(r.ChrID(), r.Position(), r.PositionEnd(), dict.Encode(bx.data, bx.size))) {
+	  std::cerr << "Region query returned unsorted reads at " << r.Brief() << std::endl;
+	  exit(EXIT_FAILURE);
+	}
+      }
+      sweep.Finish();
+    });
+}
@@ -1,6 +1,16 @@
 #ifndef BXTOOLS_TILE_H__
 #define BXTOOLS_TILE_H__
 
+#include <ostream>
+
+#include "SeqLib/BamHeader.h"
+
+#include "bxvisitor.h"
+
 void runTile(int argc, char** argv);
 
+// parse tile options from argv (argv[1] is the BAM) and return the per-read
+// accumulator, writing tiles to os (or the -o matrix)
+BXVisitor* NewTileVisitor(int argc, char** argv, const SeqLib::BamHeader& hdr, std::ostream& os);
+
 #endif
@@ -5,35 +5,121 @@
  */
 
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <bxcommon.h>
+#include <bxprof.h>
 #include <bxsplit.h>
 #include <bxstats.h>
 #include <bxtile.h>
 #include <bxrelabel.h>
+#include <bxunrelabel.h>
 #include <bxconvert.h>
 #include <bxmol.h>
 #include <bxgroup.h>
+#include <bxmulti.h>
+#include <bxindex.h>
+#include <bxoverlap.h>
+#include <bxdictfile.h>
 
 static const char *USAGE_MESSAGE =
 "Program: bxtools \n"
 "Contact: Jeremiah Wala [ jwala@broadinstitute.org ]\n"
-"Usage: snowman <command> [options]\n\n"
+"Usage: bxtools [-@ <threads>] [--dict <file>] [--stats-json <file>] [--progress <sec>] <command> [options]\n\n"
 "Commands:\n"
 "           split          Split a BAM into multiple BAMs, one per BX tag\n"
 "           stats          Collect BX-level statistics across a BAM\n"
 "           tile           Collect BX-level coverage in tiles or regions along genome\n"
 "           group          Group together BX tags into molecules\n"
 "           relabel        Move BX barcodes from BX tags (e.g. BX:TAATACG) to qname_TAATACG\n"
+"           unrelabel      Move BX barcodes from qname_TAATACG back to BX tags, or undo convert\n"
 "           mol            Output BED with footprint of each molecule (from MI tag)\n"
 "           convert        Flip the BX tag and chromosome, so as to allow for a BX-sorted and indexable BAM\n"
+"           multi          Run stats, tile and mol together in one pass over a BAM\n"
+"           index          Write a sidecar index of a BAM by BX tag\n"
+"           fetch          Write the reads of some BX tags, using the index\n"
+"           overlap        Count barcodes shared between distant tiles, from a tile -o matrix\n"
+"           dict           Write a barcode dictionary of a library, for --dict\n"
+"\nGlobal options (may be given anywhere on the command line)\n"
+"  -@, --threads          Number of threads for BAM compression and decompression [1]\n"
+"      --dict             Barcode dictionary from bxtools dict, for fixed barcode IDs in split, stats, tile, mol and convert\n"
+"      --stats-json       Write a JSON report of throughput, time per phase, peak RSS and hash map sizes (- for stderr)\n"
+"      --progress         Print reads/s and memory every this many seconds [0, off]\n"
 "\nReport bugs to jwala@broadinstitute.org \n\n";
 
+// if argv[i] is the option (short form s, which may have the value attached,
+// or long form l), point val at its value and return the number of args
+// used. Returns 0 if it is not the option
+static int matchOption(int argc, char** argv, int i, const char* s, const char* l, const char*& val) {
+  const size_t ll = strlen(l);
+  if ((s && !strcmp(argv[i], s)) || !strcmp(argv[i], l)) {
+    if (i + 1 >= argc) {
+      std::cerr << "Option " << argv[i] << " requires a value" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    val = argv[i + 1];
+    return 2;
+  } else if (s && !strncmp(argv[i], s, strlen(s))) {
+    val = argv[i] + strlen(s);
+    return 1;
+  } else if (!strncmp(argv[i], l, ll) && argv[i][ll] == '=') {
+    val = argv[i] + ll + 1;
+    return 1;
+  }
+  return 0;
+}
+
+// the integer value of option name, or exit with the usage message if val is
+// not a whole number
+static int intOption(const char* name, const char* val) {
+  char* end;
+  errno = 0;
+  const long v = strtol(val, &end, 10);
+  if (end == val || *end || errno == ERANGE || v < INT_MIN || v > INT_MAX) {
+    std::cerr << "Option " << name << " expects a number: " << val << "\n\n" << USAGE_MESSAGE;
+    exit(EXIT_FAILURE);
+  }
+  return v;
+}
+
+// pull the global options out of argv, so every subcommand sees only its own options
+static int parseGlobalOptions(int argc, char** argv) {
+
+  int n = 1;
+  for (int i = 1; i < argc; ++i) {
+    const char* val = nullptr;
+    int used;
+    if ((used = matchOption(argc, argv, i, "-@", "--threads", val)))
+      bxtools::threads = std::max(1, intOption("--threads", val));
+    else if ((used = matchOption(argc, argv, i, nullptr, "--dict", val)))
+      bxtools::dict_file = val;
+    else if ((used = matchOption(argc, argv, i, nullptr, "--stats-json", val)))
+      bxtools::stats_json = val;
+    else if ((used = matchOption(argc, argv, i, nullptr, "--progress", val)))
+      bxtools::progress = std::max(0, intOption("--progress", val));
+    else {
+      argv[n++] = argv[i];
+      continue;
+    }
+    i += used - 1;
+  }
+  argv[n] = nullptr;
+  return n;
+}
+
 int main(int argc, char** argv) {
 
+  argc = parseGlobalOptions(argc, argv);
+
   if (argc <= 1) {
     std::cerr << USAGE_MESSAGE;
     return 0;
   } else {
     std::string command(argv[1]);
+    bxtools::Profile().Start(command);
     if (command == "help" || command == "--help") {
       std::cerr << USAGE_MESSAGE;
       return 0;
@@ -45,12 +131,24 @@ int main(int argc, char** argv) {
       runTile(argc -1, argv + 1);
     } else if (command == "relabel") {
       runRelabel(argc -1, argv + 1);
+    } else if (command == "unrelabel") {
+      runUnrelabel(argc -1, argv + 1);
     } else if (command == "convert"){
       runConvert(argc -1, argv + 1);
     } else if (command == "group") {
       runGroup(argc -1, argv + 1);
     } else if (command == "mol") {
       runMol(argc -1, argv + 1);
+    } else if (command == "multi") {
+      runMulti(argc -1, argv + 1);
+    } else if (command == "index") {
+      runIndex(argc -1, argv + 1);
+    } else if (command == "fetch") {
+      runFetch(argc -1, argv + 1);
+    } else if (command == "overlap") {
+      runOverlap(argc -1, argv + 1);
+    } else if (command == "dict") {
+      runDict(argc -1, argv + 1);
     }
     else {
       std::cerr << USAGE_MESSAGE;
@@ -58,6 +156,7 @@ int main(int argc, char** argv) {
     }
   } 
 
+  bxtools::Profile().Finish();
   return 0;
 
 }
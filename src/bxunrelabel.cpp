@@ -0,0 +1,205 @@
+#include "bxunrelabel.h"
+
+#include <string>
+#include <getopt.h>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+
+#include "bxcommon.h"
+#include "bxprof.h"
+#include "bxraw.h"
+
+#include "SeqLib/BamReader.h"
+#include "SeqLib/BamWriter.h"
+
+namespace opt {
+  static std::string bam; // the bam to restore
+  static bool verbose = false; 
+  static std::string tag = "BX"; // tag to restore
+  static bool convert = false; // undo convert rather than relabel
+  static std::string header; // BAM with the header from before convert
+}
+
+static const char* shortopts = "hvct:H:";
+static const struct option longopts[] = {
+  { "help",                    no_argument, NULL, 'h' },
+  { "verbose",                 no_argument, NULL, 'v' },
+  { "tag",                     required_argument, NULL, 't' },
+  { "convert",                 no_argument, NULL, 'c' },
+  { "header",                  required_argument, NULL, 'H' },
+  { NULL, 0, NULL, 0 }
+};
+
+static const char *UNRELABEL_USAGE_MESSAGE =
+"Usage: bxtools unrelabel input.bam > restored.bam \n"
+"Description: Move BX barcodes from qname_BARCODE back to the BX tag (undo relabel)\n"
+"\n"
+"  General options\n"
+"  -v, --verbose                        Select verbosity level (0-4). Default: 0 \n"
+"  -h, --help                           Display this help and exit\n"
+"  -t, --tag                            Tag to restore. Default: BX\n"
+"  -c, --convert                        Undo convert -k instead: chromosome and position from the CR and POS tags,\n"
+"                                       BX from the chromosome. Mate positions are not restored\n"
+"  -H, --header                         With -c, a BAM/SAM with the original (pre-convert) header\n"
+"\n";
+
+static void parseOptions(int argc, char** argv) {
+
+  bool die = false;
+  if (argc < 2) 
+    die = true;
+  else
+    opt::bam = std::string(argv[1]);
+
+  bool help = false;
+  std::stringstream ss;
+
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v': opt::verbose = true; break;
+    case 'h': help = true; break;
+    case 't': arg >> opt::tag; break;
+    case 'c': opt::convert = true; break;
+    case 'H': arg >> opt::header; break;
+    }
+  }
+
+  if (opt::tag.length() != 2) {
+    std::cerr << "Tag should be two characters: " << opt::tag << std::endl;
+    die = true;
+  }
+
+  if (opt::convert && opt::header.empty()) {
+    std::cerr << "Undoing convert (-c) requires the original header (-H)" << std::endl;
+    die = true;
+  }
+  
+  if (die || help) {
+    std::cerr << "\n" << UNRELABEL_USAGE_MESSAGE;
+    die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
+  }
+}
+
+// Undoes convert -k on a raw record. The barcode comes from the converted
+// chromosome name (with "_" back to "-"), and the original chromosome and
+// position from the CR and POS tags (htslib stores the latter as PO)
+class BXUnconvert {
+
+public:
+
+  BXUnconvert(const SeqLib::BamHeader& converted, const SeqLib::BamHeader& original) {
+    for (const auto& s : converted.GetHeaderSequenceVector()) {
+      std::string bx = s.Name;
+      for (auto& c : bx)
+	if (c == '_')
+	  c = '-';
+      m_bx.push_back(bx == "Empty" ? std::string() : bx);
+    }
+    int i = 0;
+    for (const auto& s : original.GetHeaderSequenceVector())
+      m_chr[s.Name] = i++;
+  }
+
+  // returns false if the record lacks the tags from convert -k
+  bool Restore(bam1_t* b) {
+
+    uint8_t* cr = bam_aux_get(b, "CR");
+    uint8_t* pos = bam_aux_get(b, "PO");
+    if (!pos)
+      pos = bam_aux_get(b, "PS");
+    if (!cr || !pos || *cr != 'Z')
+      return false;
+
+    int32_t tid = -1;
+    m_name.assign(bam_aux2Z(cr));
+    if (m_name != "*") {
+      auto ff = m_chr.find(m_name);
+      if (ff == m_chr.end())
+	return false;
+      tid = ff->second;
+    }
+    const int32_t p = bam_aux2i(pos);
+
+    // barcode, unless convert kept the tag
+    const int32_t bxid = b->core.tid;
+    if (bxid >= 0 && bxid < (int32_t)m_bx.size() && !m_bx[bxid].empty() && !bam_aux_get(b, opt::tag.c_str()))
+      bam_aux_append(b, opt::tag.c_str(), 'Z', m_bx[bxid].length() + 1, (const uint8_t*)m_bx[bxid].c_str());
+
+    bam_aux_del(b, bam_aux_get(b, "CR"));
+    pos = bam_aux_get(b, "PO");
+    bam_aux_del(b, pos ? pos : bam_aux_get(b, "PS"));
+
+    b->core.tid = tid;
+    b->core.pos = p;
+    b->core.bin = hts_reg2bin(p, bam_endpos(b), 14, 5);
+    return true;
+  }
+
+private:
+  
+  std::vector<std::string> m_bx; // barcode for each converted chromosome
+  std::unordered_map<std::string, int32_t> m_chr;
+  std::string m_name;
+  
+};
+
+void runUnrelabel(int argc, char** argv) {
+
+  parseOptions(argc, argv);
+  
+  // open the read BAM
+  SeqLib::BamReader reader;
+  BXOPEN(reader, opt::bam);
+
+  SeqLib::BamHeader hdr = reader.Header();
+  BXUnconvert* unconvert = nullptr;
+  if (opt::convert) {
+    SeqLib::BamReader orig;
+    BXOPEN(orig, opt::header);
+    unconvert = new BXUnconvert(hdr, orig.Header());
+    // the records are still in converted (barcode) order
+    hdr = SeqLib::BamHeader(bxtools::UnsortedHeader(orig.Header().AsString()));
+  }
+  
+  // open the write BAM
+  SeqLib::BamWriter w;
+  if (!w.Open("-"))  {
+    std::cerr << "Failed to open output stream" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  BXTHREADS(w)
+  w.SetHeader(hdr);
+  w.WriteHeader();
+  
+  // loop and write
+  SeqLib::BamRecord r;
+  size_t count = 0;
+  size_t found = 0;
+  while (BXNextRecord(reader, r)) {
+
+    BXLOOPCHECK(r, found, (opt::convert ? "CR" : "qname_BARCODE"));
+
+    if (unconvert) {
+      if (!unconvert->Restore(r.raw())) {
+	std::cerr << "Read " << r.Qname() << " has no CR and POS tags from convert -k, or a chromosome "
+		  << "missing from the header of " << opt::header << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      ++found;
+    } else if (BXUnrelabelRaw(r.raw(), opt::tag.c_str()) == BXRAW_OK) {
+      ++found;
+    } else if (opt::verbose) {
+      std::cerr << "No barcode in read name: " << r.Qname() << std::endl;
+    }
+    
+    if (!w.WriteRecord(r)) {
+      std::cerr << "failed to write read " << r << " to BAM" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  
+  w.Close();
+  delete unconvert;
+}
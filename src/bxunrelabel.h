@@ -0,0 +1,6 @@
+#ifndef BXTOOLS_BXUNRELABEL_H__
+#define BXTOOLS_BXUNRELABEL_H__
+
+void runUnrelabel(int argc, char** argv);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef BXTOOLS_BXVARINT_H__
+#define BXTOOLS_BXVARINT_H__
+
+#include <cstdint>
+#include <string>
+
+// LEB128 varints, for the delta coded lists in the binary output formats
+
+inline void BXPutVarint(std::string& s, uint64_t v) {
+  while (v >= 0x80) {
+    s.push_back((char)(v | 0x80));
+    v >>= 7;
+  }
+  s.push_back((char)v);
+}
+
+inline uint64_t BXGetVarint(const unsigned char*& p) {
+  uint64_t v = 0;
+  int shift = 0;
+  while (*p & 0x80) {
+    v |= (uint64_t)(*p++ & 0x7f) << shift;
+    shift += 7;
+  }
+  v |= (uint64_t)(*p++) << shift;
+  return v;
+}
+
+#endif
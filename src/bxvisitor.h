@@ -0,0 +1,22 @@
+#ifndef BXTOOLS_BXVISITOR_H__
+#define BXTOOLS_BXVISITOR_H__
+
+#include "SeqLib/BamRecord.h"
+
+// One analysis over the reads of a BAM, fed a record at a time, so that
+// several can share a single pass over the file (bxtools multi)
+class BXVisitor {
+
+ public:
+
+  virtual ~BXVisitor() {}
+
+  // called for every read, in file order
+  virtual void Visit(const SeqLib::BamRecord& r) = 0;
+
+  // called after the last read, to write out the results
+  virtual void Finish() = 0;
+
+};
+
+#endif